@@ -0,0 +1,79 @@
+#ifndef ALIAS_HH
+#define ALIAS_HH
+
+#include <stdint.h>
+#include <assert.h>
+#include <vector>
+
+#include <gsl/gsl_rng.h>
+
+using namespace std;
+
+// draws from a fixed discrete distribution in O(1) after O(n) setup
+// (Walker's alias method, with Vose's construction of the table);
+// weights need not be normalized
+class AliasTable {
+public:
+  AliasTable(const vector<double> &w);
+
+  uint32_t sample(gsl_rng *r) const;
+  double prob(uint32_t i) const { return _p[i]; }
+  uint32_t n() const { return _p.size(); }
+
+private:
+  vector<double> _p;
+  vector<double> _accept;
+  vector<uint32_t> _alias;
+};
+
+inline
+AliasTable::AliasTable(const vector<double> &w)
+  : _p(w.size()), _accept(w.size()), _alias(w.size())
+{
+  uint32_t n = w.size();
+  assert (n > 0);
+
+  double s = .0;
+  for (uint32_t i = 0; i < n; ++i) {
+    assert (w[i] >= 0);
+    s += w[i];
+  }
+  assert (s > 0);
+
+  vector<uint32_t> small, large;
+  for (uint32_t i = 0; i < n; ++i) {
+    _p[i] = w[i] / s;
+    _accept[i] = _p[i] * n;
+    _alias[i] = i;
+    if (_accept[i] < 1.0)
+      small.push_back(i);
+    else
+      large.push_back(i);
+  }
+
+  // pair each under-full column with an over-full one
+  while (!small.empty() && !large.empty()) {
+    uint32_t a = small.back(), b = large.back();
+    small.pop_back();
+    _alias[a] = b;
+    _accept[b] -= 1.0 - _accept[a];
+    if (_accept[b] < 1.0) {
+      large.pop_back();
+      small.push_back(b);
+    }
+  }
+  // what is left is full up to rounding
+  for (uint32_t i = 0; i < small.size(); ++i)
+    _accept[small[i]] = 1.0;
+  for (uint32_t i = 0; i < large.size(); ++i)
+    _accept[large[i]] = 1.0;
+}
+
+inline uint32_t
+AliasTable::sample(gsl_rng *r) const
+{
+  uint32_t i = gsl_rng_uniform_int(r, _p.size());
+  return gsl_rng_uniform(r) < _accept[i] ? i : _alias[i];
+}
+
+#endif
@@ -0,0 +1,270 @@
+#ifndef ELBO_HH
+#define ELBO_HH
+
+#include <stdint.h>
+#include <math.h>
+#include <vector>
+#include "env.hh"
+#include "matrix.hh"
+#include "thread.hh"
+#include "philox.hh"
+
+#include <gsl/gsl_cblas.h>
+
+// evidence lower bound of the threaded engines (D, E and G), split
+// as in SNPSamplingB::logl() into
+//   theta: E[log p(theta)] - E[log q(theta)]
+//   data:  E[log p(y, z | theta, beta)] - E[log q(z)]
+//   beta:  E[log p(beta)] - E[log q(beta)]
+//
+// at their optimum the phis drop out of the data term; a genotype y
+// contributes
+//   y log(t_n . b0_l) + (2 - y) log(t_n . b1_l) + log C(2, y)
+// with t_n = exp(Elogtheta_n) and bt_l = exp(Elogbeta_l[.][t]), so
+// a tile of individuals x loci is a single dgemm
+//
+// the theta term is exact; the data and beta terms are summed over
+// all loci, or over m loci drawn uniformly with replacement and
+// scaled by L / m, which keeps the estimate unbiased
+//
+// the bound is evaluated once per -rfreq iterations and is not on the
+// inference path, so an evaluation starts and joins its own workers
+// rather than borrowing the engine's pool, whose workers are tied to
+// its per-iteration protocol; thread start-up and the N K + 3 L K
+// scalar lgammas are small next to the N L logs of the data term
+//
+// P needs Elogtheta(), Elogbeta(), gamma(), lambda(), eta(),
+// alpha(k), kv_ok() and a thread-safe fill_y()
+template<class P>
+class ELBO {
+public:
+  ELBO(const Env &env, P &pop, uint32_t nthreads);
+
+  // m = 0 sums over all loci
+  double compute(uint32_t m, double &ptheta, double &pdata,
+		 double &pbeta);
+
+  void theta_part(uint32_t first, uint32_t last, double &s);
+  void loci_part(uint32_t first, uint32_t last,
+		 double &sdata, double &sbeta);
+
+  static const uint32_t NBLOCK = 512;
+  static const uint32_t LBLOCK = 16;
+  static const uint32_t ELBO_STREAM = 5;
+
+private:
+  static double lngamma(double x) { int sg; return lgamma_r(x, &sg); }
+  void run(bool theta, uint32_t size, double &s1, double &s2);
+
+  const Env &_env;
+  P &_pop;
+  uint32_t _n;
+  uint32_t _k;
+  uint32_t _l;
+  uint32_t _nthreads;
+  uint32_t _evals;
+
+  vector<double> _etheta;	// n x k, exp(Elogtheta)
+  vector<uint32_t> _locs;	// loci in this evaluation
+  double _alpha_norm;		// lnG(sum alpha) - sum lnG(alpha)
+  vector<double> _eta_norm;	// per k, same for eta
+};
+
+template<class P>
+class ELBOWorker : public Thread {
+public:
+  ELBOWorker(ELBO<P> &elbo, bool theta, uint32_t first, uint32_t last)
+    : _elbo(elbo), _theta(theta), _first(first), _last(last),
+      _s1(.0), _s2(.0) { }
+  ~ELBOWorker() { }
+
+  int do_work();
+  double s1() const { return _s1; }
+  double s2() const { return _s2; }
+
+private:
+  ELBO<P> &_elbo;
+  bool _theta;
+  uint32_t _first;
+  uint32_t _last;
+  double _s1;
+  double _s2;
+};
+
+template<class P> int
+ELBOWorker<P>::do_work()
+{
+  if (_theta)
+    _elbo.theta_part(_first, _last, _s1);
+  else
+    _elbo.loci_part(_first, _last, _s1, _s2);
+  return 0;
+}
+
+template<class P>
+ELBO<P>::ELBO(const Env &env, P &pop, uint32_t nthreads)
+  : _env(env), _pop(pop),
+    _n(env.n), _k(env.k), _l(env.l),
+    _nthreads(nthreads > 0 ? nthreads : 1),
+    _evals(0),
+    _etheta((size_t)env.n * env.k),
+    _eta_norm(env.k)
+{
+  double a = .0, v = .0;
+  for (uint32_t k = 0; k < _k; ++k) {
+    a += _pop.alpha(k);
+    v += lngamma(_pop.alpha(k));
+  }
+  _alpha_norm = lngamma(a) - v;
+
+  const double ** const etad = _pop.eta().const_data();
+  for (uint32_t k = 0; k < _k; ++k)
+    _eta_norm[k] = lngamma(etad[k][0] + etad[k][1])
+      - lngamma(etad[k][0]) - lngamma(etad[k][1]);
+}
+
+template<class P> double
+ELBO<P>::compute(uint32_t m, double &ptheta, double &pdata, double &pbeta)
+{
+  double s;
+  run(true, _n, ptheta, s);
+
+  if (m == 0 || m >= _l) {
+    _locs.resize(_l);
+    for (uint32_t l = 0; l < _l; ++l)
+      _locs[l] = l;
+  } else {
+    // a fresh sample per evaluation, off the engine's rng
+    Philox g((uint64_t)_env.seed, ELBO_STREAM, _evals, 0);
+    _locs.resize(m);
+    for (uint32_t i = 0; i < m; ++i)
+      _locs[i] = g.uniform_int(_l);
+  }
+  _evals++;
+
+  run(false, _locs.size(), pdata, pbeta);
+  double scale = (double)_l / _locs.size();
+  pdata *= scale;
+  pbeta *= scale;
+  return ptheta + pdata + pbeta;
+}
+
+// workers get contiguous ranges; partial sums are added in range
+// order so the result does not depend on scheduling
+template<class P> void
+ELBO<P>::run(bool theta, uint32_t size, double &s1, double &s2)
+{
+  s1 = s2 = .0;
+  uint32_t nt = _nthreads < size ? _nthreads : size;
+  if (nt <= 1) {
+    if (theta)
+      theta_part(0, size, s1);
+    else
+      loci_part(0, size, s1, s2);
+    return;
+  }
+  vector<ELBOWorker<P> *> w(nt);
+  for (uint32_t i = 0; i < nt; ++i) {
+    uint32_t first = (uint64_t)size * i / nt;
+    uint32_t last = (uint64_t)size * (i + 1) / nt;
+    w[i] = new ELBOWorker<P>(*this, theta, first, last);
+    if (w[i]->create() != 0) {
+      lerr("error: failed to create elbo thread\n");
+      exit(-1);
+    }
+  }
+  for (uint32_t i = 0; i < nt; ++i) {
+    w[i]->join();
+    s1 += w[i]->s1();
+    s2 += w[i]->s2();
+    delete w[i];
+  }
+}
+
+// also fills the individuals' rows of exp(Elogtheta)
+template<class P> void
+ELBO<P>::theta_part(uint32_t first, uint32_t last, double &s)
+{
+  const double ** const elogthetad = _pop.Elogtheta().const_data();
+  const double ** const gd = _pop.gamma().const_data();
+
+  s = .0;
+  for (uint32_t n = first; n < last; ++n) {
+    double gsum = .0, v = .0, w = .0;
+    double *et = &_etheta[(size_t)n * _k];
+    for (uint32_t k = 0; k < _k; ++k) {
+      gsum += gd[n][k];
+      v += lngamma(gd[n][k]);
+      w += (_pop.alpha(k) - gd[n][k]) * elogthetad[n][k];
+      et[k] = exp(elogthetad[n][k]);
+    }
+    s += _alpha_norm - (lngamma(gsum) - v) + w;
+  }
+}
+
+template<class P> void
+ELBO<P>::loci_part(uint32_t first, uint32_t last,
+		   double &sdata, double &sbeta)
+{
+  // log C(2, y)
+  static const double logcoeff[3] = { .0, M_LN2, .0 };
+
+  const double *** const elogbetad = _pop.Elogbeta().const_data();
+  const double *** const ld = _pop.lambda().const_data();
+  const double ** const etad = _pop.eta().const_data();
+
+  vector<double> b(2 * LBLOCK * _k);
+  vector<double> c(NBLOCK * 2 * LBLOCK);
+  vector<YArray *> y(LBLOCK);
+  for (uint32_t j = 0; j < LBLOCK; ++j)
+    y[j] = new YArray(_n);
+
+  sdata = sbeta = .0;
+  for (uint32_t i = first; i < last; i += LBLOCK) {
+    uint32_t lb = last - i < LBLOCK ? last - i : LBLOCK;
+
+    // rows 2j and 2j+1 of b are exp(Elogbeta) of the j-th locus
+    for (uint32_t j = 0; j < lb; ++j) {
+      uint32_t loc = _locs[i + j];
+      _pop.fill_y(loc, *y[j]);
+      for (uint32_t k = 0; k < _k; ++k) {
+	b[(2 * j) * _k + k] = exp(elogbetad[loc][k][0]);
+	b[(2 * j + 1) * _k + k] = exp(elogbetad[loc][k][1]);
+
+	double l0 = ld[loc][k][0], l1 = ld[loc][k][1];
+	sbeta += _eta_norm[k] - (lngamma(l0 + l1) - lngamma(l0) - lngamma(l1))
+	  + (etad[k][0] - l0) * elogbetad[loc][k][0]
+	  + (etad[k][1] - l1) * elogbetad[loc][k][1];
+      }
+    }
+
+    for (uint32_t n0 = 0; n0 < _n; n0 += NBLOCK) {
+      uint32_t nb = _n - n0 < NBLOCK ? _n - n0 : NBLOCK;
+      cblas_dgemm(CblasRowMajor, CblasNoTrans, CblasTrans,
+		  nb, 2 * lb, _k, 1.0, &_etheta[(size_t)n0 * _k], _k,
+		  &b[0], _k, 0.0, &c[0], 2 * lb);
+
+      for (uint32_t j = 0; j < lb; ++j) {
+	uint32_t loc = _locs[i + j];
+	const yval_t * const yd = y[j]->const_data();
+	for (uint32_t r = 0; r < nb; ++r) {
+	  uint32_t n = n0 + r;
+	  if (!_pop.kv_ok(n, loc))
+	    continue;
+	  yval_t x = yd[n];
+	  double q0 = c[r * 2 * lb + 2 * j];
+	  double q1 = c[r * 2 * lb + 2 * j + 1];
+	  if (q0 < 1e-300)
+	    q0 = 1e-300;
+	  if (q1 < 1e-300)
+	    q1 = 1e-300;
+	  sdata += x * log(q0) + (2 - x) * log(q1) + logcoeff[x];
+	}
+      }
+    }
+  }
+  for (uint32_t j = 0; j < LBLOCK; ++j)
+    delete y[j];
+}
+
+#endif
@@ -57,6 +57,13 @@ public:
       uint32_t rfreq, bool logl, bool loadcmp,
       double seed, bool file_suffix,
       bool save_beta, bool adagrad, uint32_t nthreads,
+      uint32_t tile_size, bool pin_threads,
+      uint32_t async_groups, uint32_t conv_loci,
+      uint32_t elbo_loci, bool maf_sampling, bool saga,
+      bool adaptive_rho, uint32_t lazy_theta,
+      uint32_t active_set, uint32_t topm,
+      uint32_t locus_batch, uint32_t epoch_block,
+      string project, string incremental,
       bool simulation, bool use_test_set,
       bool compute_beta, string locations_file,
       double stop_threshold);
@@ -72,9 +79,31 @@ public:
   uint32_t blocks;
   uint32_t indiv_sample_size;
   uint32_t nthreads;
+  uint32_t tile_size;
+  bool pin_threads;
+  uint32_t async_groups;
+  uint32_t conv_loci;
+  uint32_t elbo_loci;
+  bool maf_sampling;
+  bool saga;
+  bool adaptive_rho;
+  uint32_t lazy_theta;
+  uint32_t active_set;
+  uint32_t topm;
+  uint32_t locus_batch;
+  uint32_t epoch_block;
+  string project;
+  string incremental;
 
   bool batch_mode;
   double meanchangethresh;
+  double lambda_reltol;
+  double theta_reltol;
+  double active_tol;
+  uint32_t topm_refresh;
+  uint32_t project_sweeps;
+  double project_tol;
+  uint32_t incremental_warmup;
   double alpha;
 
   double validation_ratio;
@@ -178,6 +207,13 @@ Env::plog(string s, const uint64_t &v)
   fflush(_plogf);
 }
 
+template<> inline void
+Env::plog(string s, const string &v)
+{
+  fprintf(_plogf, "%s: %s\n", s.c_str(), v.c_str());
+  fflush(_plogf);
+}
+
 inline string
 Env::file_str(string fname)
 {
@@ -194,7 +230,14 @@ Env::Env(uint32_t N, uint32_t K, uint32_t L,
 	 uint32_t rfreq, bool logl, bool lcmp, 
 	 double seedv, bool file_suffixv, 
 	 bool save_betav, bool adagradv, 
-	 uint32_t nthreadsv, bool simulationv,
+	 uint32_t nthreadsv, uint32_t tile_sizev,
+	 bool pin_threadsv, uint32_t async_groupsv,
+	 uint32_t conv_lociv, uint32_t elbo_lociv,
+	 bool maf_samplingv, bool sagav, bool adaptive_rhov,
+	 uint32_t lazy_thetav, uint32_t active_setv,
+	 uint32_t topmv, uint32_t locus_batchv,
+	 uint32_t epoch_blockv, string projectv,
+	 string incrementalv, bool simulationv,
 	 bool use_test_setv, bool compute_betav,
 	 string locations_filev,
 	 double stop_thresholdv)
@@ -205,8 +248,30 @@ Env::Env(uint32_t N, uint32_t K, uint32_t L,
     blocks(100),
     indiv_sample_size(N/blocks),
     nthreads(nthreadsv),
+    tile_size(tile_sizev),
+    pin_threads(pin_threadsv),
+    async_groups(async_groupsv),
+    conv_loci(conv_lociv),
+    elbo_loci(elbo_lociv),
+    maf_sampling(maf_samplingv),
+    saga(sagav),
+    adaptive_rho(adaptive_rhov),
+    lazy_theta(lazy_thetav),
+    active_set(active_setv),
+    topm(topmv),
+    locus_batch(locus_batchv),
+    epoch_block(epoch_blockv),
+    project(projectv),
+    incremental(incrementalv),
     batch_mode(batch),
     meanchangethresh(0.001),
+    lambda_reltol(1e-3),
+    theta_reltol(0.05),
+    active_tol(1e-3),
+    topm_refresh(16),
+    project_sweeps(200),
+    project_tol(1e-4),
+    incremental_warmup(L),
     alpha((double)1.0/k),
     heldout_indiv_ratio(0.001),
     validation_ratio(0.005),
@@ -291,6 +356,21 @@ Env::Env(uint32_t N, uint32_t K, uint32_t L,
   plog("t", t);
   plog("l", l);
   plog("nthreads", nthreads);
+  plog("tile_size", tile_size);
+  plog("pin_threads", pin_threads);
+  plog("async_groups", async_groups);
+  plog("conv_loci", conv_loci);
+  plog("elbo_loci", elbo_loci);
+  plog("maf_sampling", maf_sampling);
+  plog("saga", saga);
+  plog("adaptive_rho", adaptive_rho);
+  plog("lazy_theta", lazy_theta);
+  plog("active_set", active_set);
+  plog("topm", topm);
+  plog("locus_batch", locus_batch);
+  plog("epoch_block", epoch_block);
+  plog("project", project);
+  plog("incremental", incremental);
   plog("tau0", tau0);
   plog("nodetau0", nodetau0);
   plog("kappa", kappa);
@@ -299,6 +379,13 @@ Env::Env(uint32_t N, uint32_t K, uint32_t L,
   plog("heldout_indiv_ratio", heldout_indiv_ratio);
   plog("validation_ratio", validation_ratio);
   plog("online_iterations", online_iterations);
+  plog("lambda_reltol", lambda_reltol);
+  plog("theta_reltol", theta_reltol);
+  plog("active_tol", active_tol);
+  plog("topm_refresh", topm_refresh);
+  plog("project_sweeps", project_sweeps);
+  plog("project_tol", project_tol);
+  plog("incremental_warmup", incremental_warmup);
   plog("GSL seed", seed);
   plog("file suffix", file_suffix);
   plog("save beta", save_beta);
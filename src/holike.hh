@@ -0,0 +1,110 @@
+#ifndef HOLIKE_HH
+#define HOLIKE_HH
+
+#include <stdint.h>
+#include <math.h>
+#include <vector>
+#include "env.hh"
+
+#include <gsl/gsl_cblas.h>
+
+// heldout log likelihood of genotypes under Binomial(2, q), with
+// q = theta_n . beta for the individuals held out at one locus
+//
+// individuals are scored in blocks: their theta rows are gathered
+// into a contiguous matrix and all q of a block come from one dgemv;
+// the binomial coefficients come from a table rather than
+// gsl_sf_fact() per genotype
+class HOLikelihood {
+public:
+  HOLikelihood(uint32_t k);
+
+  // genotypes indexed by individual
+  double score(const double * const *theta, const double *beta,
+	       const vector<uint32_t> &indivs, const yval_t *y);
+  // genotypes from column loc of an individual x location matrix
+  double score(const double * const *theta, const double *beta,
+	       const vector<uint32_t> &indivs,
+	       const yval_t * const *snpd, uint32_t loc);
+
+  static const uint32_t BLOCK = 256;
+
+private:
+  double block(const double * const *theta, const double *beta,
+	       const uint32_t *indivs, uint32_t m);
+
+  uint32_t _k;
+  vector<double> _a;
+  vector<double> _q;
+  vector<yval_t> _x;
+};
+
+inline
+HOLikelihood::HOLikelihood(uint32_t k)
+  : _k(k), _a(BLOCK * k), _q(BLOCK), _x(BLOCK)
+{
+}
+
+inline double
+HOLikelihood::score(const double * const *theta, const double *beta,
+		    const vector<uint32_t> &indivs, const yval_t *y)
+{
+  double lsum = .0;
+  for (uint32_t i = 0; i < indivs.size(); i += BLOCK) {
+    uint32_t m = indivs.size() - i < BLOCK ? indivs.size() - i : BLOCK;
+    for (uint32_t j = 0; j < m; ++j)
+      _x[j] = y[indivs[i + j]];
+    lsum += block(theta, beta, &indivs[i], m);
+  }
+  return lsum;
+}
+
+inline double
+HOLikelihood::score(const double * const *theta, const double *beta,
+		    const vector<uint32_t> &indivs,
+		    const yval_t * const *snpd, uint32_t loc)
+{
+  double lsum = .0;
+  for (uint32_t i = 0; i < indivs.size(); i += BLOCK) {
+    uint32_t m = indivs.size() - i < BLOCK ? indivs.size() - i : BLOCK;
+    for (uint32_t j = 0; j < m; ++j)
+      _x[j] = snpd[indivs[i + j]][loc];
+    lsum += block(theta, beta, &indivs[i], m);
+  }
+  return lsum;
+}
+
+inline double
+HOLikelihood::block(const double * const *theta, const double *beta,
+		    const uint32_t *indivs, uint32_t m)
+{
+  // C(2, x)
+  static const double coeff[3] = { 1.0, 2.0, 1.0 };
+
+  double *a = &_a[0];
+  for (uint32_t j = 0; j < m; ++j) {
+    const double *t = theta[indivs[j]];
+    for (uint32_t k = 0; k < _k; ++k)
+      a[j * _k + k] = t[k];
+  }
+  cblas_dgemv(CblasRowMajor, CblasNoTrans, m, _k, 1.0, a, _k,
+	      beta, 1, 0.0, &_q[0], 1);
+
+  double lsum = .0;
+  for (uint32_t j = 0; j < m; ++j) {
+    double q = _q[j];
+    double p;
+    switch (_x[j]) {
+    case 0:  p = (1 - q) * (1 - q); break;
+    case 1:  p = q * (1 - q); break;
+    default: p = q * q; break;
+    }
+    double sum = coeff[_x[j]] * p;
+    if (sum < 1e-30)
+      sum = 1e-30;
+    lsum += log(sum);
+  }
+  return lsum;
+}
+
+#endif
@@ -0,0 +1,79 @@
+#ifndef LOCSCHED_HH
+#define LOCSCHED_HH
+
+#include <stdint.h>
+#include <assert.h>
+#include <vector>
+
+#include <gsl/gsl_rng.h>
+#include <gsl/gsl_randist.h>
+
+using namespace std;
+
+// epoch-based locus schedule: the loci are cut into blocks of
+// contiguous loci, each epoch visits the blocks in a fresh random
+// order and the loci of a block in random order.  every locus is
+// seen exactly once per epoch, and a genotype source that is not
+// fully in memory reads each block once per epoch, mostly
+// sequentially.  a locus is still drawn with probability 1/L on
+// average, so gamma's L scaling is unchanged
+class LocusSchedule {
+public:
+  LocusSchedule(uint32_t l, uint32_t block);
+
+  uint32_t next(gsl_rng *r);
+  uint32_t epoch() const { return _epoch; }
+
+private:
+  void next_block(gsl_rng *r);
+
+  uint32_t _l;
+  uint32_t _block;
+  vector<uint32_t> _blocks;	// block order this epoch
+  vector<uint32_t> _locs;	// the current block's loci, shuffled
+  uint32_t _bpos;
+  uint32_t _lpos;
+  uint32_t _epoch;
+};
+
+inline
+LocusSchedule::LocusSchedule(uint32_t l, uint32_t block)
+  : _l(l), _block(block > 0 ? block : 1),
+    _bpos(0), _lpos(0), _epoch(0)
+{
+  assert (_l > 0);
+  uint32_t nblocks = (_l - 1) / _block + 1;
+  _blocks.resize(nblocks);
+  for (uint32_t b = 0; b < nblocks; ++b)
+    _blocks[b] = b;
+  // the first call to next() starts epoch 1
+  _bpos = nblocks;
+}
+
+inline void
+LocusSchedule::next_block(gsl_rng *r)
+{
+  if (_bpos == _blocks.size()) {
+    gsl_ran_shuffle(r, (void *)&_blocks[0], _blocks.size(),
+		    sizeof(uint32_t));
+    _bpos = 0;
+    _epoch++;
+  }
+  uint32_t first = _blocks[_bpos++] * _block;
+  uint32_t last = first + _block < _l ? first + _block : _l;
+  _locs.resize(last - first);
+  for (uint32_t i = 0; i < _locs.size(); ++i)
+    _locs[i] = first + i;
+  gsl_ran_shuffle(r, (void *)&_locs[0], _locs.size(), sizeof(uint32_t));
+  _lpos = 0;
+}
+
+inline uint32_t
+LocusSchedule::next(gsl_rng *r)
+{
+  if (_lpos == _locs.size())
+    next_block(r);
+  return _locs[_lpos++];
+}
+
+#endif
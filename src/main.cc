@@ -7,6 +7,7 @@
 #include "snpsamplinge.hh"
 #include "snpsamplingf.hh"
 #include "snpsamplingg.hh"
+#include "project.hh"
 #include "log.hh"
 #include <stdlib.h>
 
@@ -77,6 +78,21 @@ main(int argc, char **argv)
   bool compute_beta = false;
   string locations_file = "";
   uint32_t nthreads = 6;
+  uint32_t tile_size = 0;
+  bool pin_threads = false;
+  uint32_t async_groups = 0;
+  uint32_t conv_loci = 0;
+  uint32_t elbo_loci = 0;
+  bool maf_sampling = false;
+  bool saga = false;
+  bool adaptive_rho = false;
+  uint32_t lazy_theta = 0;
+  uint32_t active_set = 0;
+  uint32_t topm = 0;
+  uint32_t locus_batch = 0;
+  uint32_t epoch_block = 0;
+  string project = "";
+  string incremental = "";
   double stop_threshold = 1e-5;
 
   if (argc == 1) {
@@ -181,6 +197,36 @@ main(int argc, char **argv)
       adagrad = true;
     } else if (strcmp(argv[i], "-nthreads") ==0){
       nthreads = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "-tile-size") ==0){
+      tile_size = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "-pin") ==0){
+      pin_threads = true;
+    } else if (strcmp(argv[i], "-async-groups") ==0){
+      async_groups = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "-conv-loci") ==0){
+      conv_loci = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "-elbo-loci") ==0){
+      elbo_loci = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "-maf-sampling") ==0){
+      maf_sampling = true;
+    } else if (strcmp(argv[i], "-saga") ==0){
+      saga = true;
+    } else if (strcmp(argv[i], "-adaptive-rho") ==0){
+      adaptive_rho = true;
+    } else if (strcmp(argv[i], "-lazy-theta") ==0){
+      lazy_theta = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "-active-set") ==0){
+      active_set = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "-topm") ==0){
+      topm = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "-locus-batch") ==0){
+      locus_batch = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "-epoch-block") ==0){
+      epoch_block = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "-project") ==0){
+      project = string(argv[++i]);
+    } else if (strcmp(argv[i], "-incremental") ==0){
+      incremental = string(argv[++i]);
     } else if (strcmp(argv[i], "-use-test-set") == 0){
       use_test_set = true;
     } else if (strcmp(argv[i], "-locations-file") == 0) {
@@ -196,15 +242,33 @@ main(int argc, char **argv)
     ++i;
   };
 
+  // -adagrad is B's own step size; D and G take their adaptive
+  // per-individual step size for it, the other engines have none
+  if (adagrad && !snpsamplingb) {
+    if (snpsamplingd || snpsamplingg) {
+      fprintf(stdout, "+ adagrad: using the adaptive step size "
+	      "(-adaptive-rho)\n");
+      adaptive_rho = true;
+    } else {
+      fprintf(stderr, "error: -adagrad is only supported by -B, -D and -G\n");
+      exit(-1);
+    }
+  }
+
+  // a batch iteration is a full pass over the loci
   if (!rfreq_set)
-    rfreq = 100000;
+    rfreq = batch ? 1 : 100000;
 
   assert (!(batch && online));
   
   Env env(n, k, l, batch, 
 	  force_overwrite_dir, datfname, label, eta_type,
 	  rfreq, logl, loadcmp, seed, file_suffix, 
-	  save_beta, adagrad, nthreads, simulation1 || simulation2 || simulation3, 
+	  save_beta, adagrad, nthreads, tile_size, pin_threads,
+	  async_groups, conv_loci, elbo_loci, maf_sampling, saga,
+	  adaptive_rho, lazy_theta, active_set, topm, locus_batch,
+	  epoch_block, project, incremental,
+	  simulation1 || simulation2 || simulation3, 
 	  use_test_set, compute_beta, locations_file, stop_threshold);
   env_global = &env;
   
@@ -250,7 +314,10 @@ main(int argc, char **argv)
   }
 
   if (!loadcmp) {  
-    if (snpsamplinga) {
+    if (project != "") {
+      Project proj(env, snp);
+      proj.infer();
+    } else if (snpsamplinga) {
       SNPSamplingA snpsamplingA(env, snp);
       snpsamplingA.infer();
     } else if (snpsamplingb) {
@@ -273,7 +340,10 @@ main(int argc, char **argv)
       snpsamplingg.infer();
     } else {
       MargInf marg(env, snp);
-      marg.infer();
+      if (env.batch_mode)
+	marg.batch_infer();
+      else
+	marg.infer();
     }
   } else {
     MargInf popinf1(env, snp);
@@ -355,6 +425,7 @@ usage()
 	  "\t-force\t\t overwrite existing output directory\n"
 	  "\t-rfreq <val>\t checks for convergence and logs output every <val> iterations\n"
 	  "\t-idmap\t\t file containing individual name/meta-data, one per line\n"
+	  "\t-async-groups <G>\t asynchronous inference with G locus runners, one thread each\n"
 	  );
   fflush(stdout);
 }
@@ -26,8 +26,18 @@ MargInf::MargInf(Env &env, SNP &snp)
    _prev_w(-2147483647),
    _prev_t(-2147483647),
    _nh(0), _nt(0),
+   _prev_h_iter(0),
    _sampled_loc(0),
-   _total_locations(0)
+   _total_locations(0),
+   _holike(_k),
+   _lambdat(_k,_t),
+   _job_gen(0),
+   _job(JOB_PHIS),
+   _job_left(0),
+   _job_ready(false),
+   _blambda(NULL),
+   _stats(NULL),
+   _stats_reduce(NULL)
 {
   printf("+ popinf initialization begin\n");
   fflush(stdout);
@@ -138,6 +148,9 @@ MargInf::~MargInf()
   fclose(_lf);
   fclose(_tef);
   fclose(_vef);
+  delete _blambda;
+  delete _stats;
+  delete _stats_reduce;
 }
 
 void
@@ -258,35 +271,21 @@ void
 MargInf::infer()
 {
   printf("Running MargInf::infer()\n");
+  if (start_threads() < 0) {
+    lerr("error: cannot start threads");
+    exit(-1);
+  }
   while (1) {
     _sampled_loc = gsl_rng_uniform_int(_r, _l);
-    const yval_t ** const snpd = _snp.y().const_data();
 
-    PopLib::set_dir_exp(_gamma, _Elogtheta);
-    
     _pcomp.reset(_sampled_loc);
-    _pcomp.update_phis_until_conv();
+    update_phis_until_conv();
     
-    const Matrix &phidad = _pcomp.phidad();
-    const Matrix &phimom = _pcomp.phimom();
-    const double **phidadd = phidad.data();
-    const double **phimomd = phimom.data();
-    
-    double scale = _env.l;
-    double **gd = _gamma.data();
-
     _noderhot = pow(_nodetau0 + _nodec, -1 * _nodekappa);
-    for (uint32_t i = 0; i < _n; ++i) {
-      if (!kv_ok(i, _sampled_loc))
-	continue;
-      
-      yval_t y = snpd[i][_sampled_loc];
-      for (uint32_t k = 0; k < _k; ++k) {
-	gd[i][k] = gd[i][k] + _noderhot *				\
-	  (_alpha[k] + (scale * (y * phimomd[i][k] + (2 - y) * phidadd[i][k])) - gd[i][k]);
-	assert (gd[i][k] >= .0);
-      }
-    }
+    if (_runners.size() > 0)
+      run_job(JOB_GAMMA);
+    else
+      update_gamma(0, _n);
     _nodec++;
 
     _iter++;
@@ -316,6 +315,263 @@ MargInf::infer()
   }
 }
 
+// gamma step for individuals [first, last) at the sampled locus.
+// every row not held out at the locus moves, and its Elogtheta is
+// recomputed with it, so this is still O(N K) digammas per iteration;
+// only the rows held out at the locus are skipped
+void
+MargInf::update_gamma(uint32_t first, uint32_t last)
+{
+  const yval_t ** const snpd = _snp.y().const_data();
+  const double ** const phidadd = _pcomp.phidad().const_data();
+  const double ** const phimomd = _pcomp.phimom().const_data();
+  double scale = _env.l;
+  double **gd = _gamma.data();
+
+  for (uint32_t i = first; i < last; ++i) {
+    if (!kv_ok(i, _sampled_loc))
+      continue;
+      
+    yval_t y = snpd[i][_sampled_loc];
+    for (uint32_t k = 0; k < _k; ++k) {
+      gd[i][k] = gd[i][k] + _noderhot *				\
+	(_alpha[k] + (scale * (y * phimomd[i][k] + (2 - y) * phidadd[i][k])) - gd[i][k]);
+      assert (gd[i][k] >= .0);
+    }
+    PopLib::set_dir_exp(i, _gamma, _Elogtheta);
+  }
+}
+
+// phis until lambda settles at the locus _pcomp was reset to; each
+// pass is split across the workers, whose lambda_t are added in
+// worker order so that the result does not depend on timing
+void
+MargInf::update_phis_until_conv()
+{
+  if (_runners.size() == 0) {
+    _pcomp.update_phis_until_conv();
+    return;
+  }
+  for (uint32_t i = 0; i < _env.online_iterations; ++i) {
+    run_job(JOB_PHIS);
+    _lambdat.zero();
+    for (uint32_t r = 0; r < _runners.size(); ++r)
+      _lambdat += _runners[r]->lambdat();
+    if (_pcomp.set_lambda(_lambdat))
+      break;
+  }
+  _pcomp.estimate_beta();
+}
+
+int
+MargInf::start_threads()
+{
+  uint32_t nt = _env.nthreads < _n ? _env.nthreads : _n;
+  if (nt <= 1)
+    return 0;
+  Thread::static_initialize();
+  for (uint32_t i = 0; i < nt; ++i) {
+    uint32_t first = (uint64_t)_n * i / nt;
+    uint32_t last = (uint64_t)_n * (i + 1) / nt;
+    uint32_t lfirst = (uint64_t)_l * i / nt;
+    uint32_t llast = (uint64_t)_l * (i + 1) / nt;
+    MargRunner *r = new MargRunner(i, first, last, lfirst, llast,
+				   _n, _k, _t, *this);
+    if (r->create() < 0)
+      return -1;
+    _runners.push_back(r);
+  }
+  Env::plog("marginf threads", nt);
+  return 0;
+}
+
+// posts a job to every worker and waits until all are done
+void
+MargInf::run_job(int job)
+{
+  _job_cm.lock();
+  _job = job;
+  _job_left = _runners.size();
+  _job_ready = false;
+  _job_gen++;
+  _job_cm.broadcast();
+  while (!_job_ready)
+    _job_cm.wait();
+  _job_cm.unlock();
+}
+
+int
+MargInf::wait_job(uint32_t &gen)
+{
+  _job_cm.lock();
+  while (_job_gen == gen)
+    _job_cm.wait();
+  gen = _job_gen;
+  int job = _job;
+  _job_cm.unlock();
+  return job;
+}
+
+void
+MargInf::job_done()
+{
+  if (__sync_sub_and_fetch(&_job_left, 1) == 0) {
+    _job_cm.lock();
+    _job_ready = true;
+    _job_cm.broadcast();
+    _job_cm.unlock();
+  }
+}
+
+int
+MargRunner::do_work()
+{
+  uint32_t gen = 0;
+  do {
+    int job = _pop.wait_job(gen);
+    if (job == MargInf::JOB_PHIS) {
+      _lambdat.zero();
+      _pop.pcomp().update_phis(_first, _last, _phinext, _lambdat);
+    } else if (job == MargInf::JOB_GAMMA)
+      _pop.update_gamma(_first, _last);
+    else if (job == MargInf::JOB_ESTEP)
+      estep();
+    else
+      _pop.mstep(_first, _last);
+    _pop.job_done();
+  } while (1);
+  return 0;
+}
+
+void
+MargRunner::estep()
+{
+  if (!_stats) {
+    _bpcomp = _pop.new_pcomp();
+    _stats = new Matrix(_n, _k);
+  }
+  _stats->zero();
+  _pop.estep(_lfirst, _llast, *_bpcomp, *_stats);
+  _pop.stats_reduce().contribute(_idx, *_stats);
+}
+
+MargPhiCompute *
+MargInf::new_pcomp()
+{
+  return new MargPhiCompute(_env, &_r, _iter, _n, _k, 0, _t,
+			    _Elogtheta, _snp, _eta, *this);
+}
+
+// batch variational inference: every iteration fits each locus'
+// lambda given theta, carrying lambda over from the last iteration
+// (E-step), then sets gamma = alpha + sum over loci of the phis
+// (M-step).  the workers split the loci for the E-step and the
+// individuals for the M-step; the result depends on the number of
+// workers only through the order of the statistics' sums
+void
+MargInf::batch_infer()
+{
+  printf("Running MargInf::batch_infer()\n");
+  if (start_threads() < 0) {
+    lerr("error: cannot start threads");
+    exit(-1);
+  }
+  init_batch();
+  while (1) {
+    if (_runners.size() > 0) {
+      run_job(JOB_ESTEP);
+      _stats_reduce->result(*_stats);
+      run_job(JOB_MSTEP);
+    } else {
+      _stats->zero();
+      estep(0, _l, _pcomp, *_stats);
+      mstep(0, _n);
+    }
+    _iter++;
+
+    lerr("iteration = %d took %d secs\n", _iter, duration());
+
+    if (_iter % _env.reportfreq == 0) {
+      printf("iteration = %d took %d secs\n", _iter, duration());
+      fflush(stdout);
+      lerr("estimating theta @ %d secs", duration());
+      estimate_all_theta();
+      lerr("computing heldout likelihood @ %d secs", duration());
+      compute_likelihood(false, true);
+      lerr("saving theta @ %d secs", duration());
+      save_model();
+      lerr("done @ %d secs", duration());
+    }
+
+    if (_env.terminate) {
+      save_model();
+      exit(0);
+    }
+  }
+}
+
+// the loci's initial lambdas are drawn here, in locus order, so that
+// they do not depend on the number of workers
+void
+MargInf::init_batch()
+{
+  _blambda = new D3(_l, _k, _t);
+  double ***ld = _blambda->data();
+  const double ** const etad = _eta.const_data();
+  double v = (_k <= 100) ? 1.0 : (double)100.0 / _k;
+  for (uint32_t l = 0; l < _l; ++l)
+    for (uint32_t k = 0; k < _k; ++k)
+      for (uint32_t t = 0; t < _t; ++t)
+	ld[l][k][t] = etad[k][t] + gsl_ran_gamma(_r, 100 * v, 0.01);
+
+  _stats = new Matrix(_n, _k);
+  if (_runners.size() > 0)
+    _stats_reduce = new TSReduce(_runners.size(), _n, _k);
+}
+
+// E-step over loci [first, last) with locus state pc, adding each
+// individual's expected allele counts per population to stats
+void
+MargInf::estep(uint32_t first, uint32_t last,
+	       MargPhiCompute &pc, Matrix &stats)
+{
+  const yval_t ** const snpd = _snp.y().const_data();
+  double **sd = stats.data();
+  double ***bld = _blambda->data();
+
+  for (uint32_t l = first; l < last; ++l) {
+    pc.reset(l, bld[l]);
+    pc.update_phis_until_conv();
+
+    const double ** const ld = pc.lambda().const_data();
+    for (uint32_t k = 0; k < _k; ++k)
+      for (uint32_t t = 0; t < _t; ++t)
+	bld[l][k][t] = ld[k][t];
+
+    const double ** const phimomd = pc.phimom().const_data();
+    const double ** const phidadd = pc.phidad().const_data();
+    for (uint32_t n = 0; n < _n; ++n) {
+      if (!kv_ok(n, l))
+	continue;
+      yval_t y = snpd[n][l];
+      for (uint32_t k = 0; k < _k; ++k)
+	sd[n][k] += y * phimomd[n][k] + (2 - y) * phidadd[n][k];
+    }
+  }
+}
+
+void
+MargInf::mstep(uint32_t first, uint32_t last)
+{
+  const double ** const sd = _stats->const_data();
+  double **gd = _gamma.data();
+  for (uint32_t n = first; n < last; ++n) {
+    for (uint32_t k = 0; k < _k; ++k)
+      gd[n][k] = _alpha[k] + sd[n][k];
+    PopLib::set_dir_exp(n, _gamma, _Elogtheta);
+  }
+}
+
 double
 MargInf::compute_likelihood(bool first, bool validation)
 {
@@ -362,11 +618,21 @@ MargInf::compute_likelihood(bool first, bool validation)
   if (!validation)
     return 0;
   
+  // batch iterations are full passes over the loci, so there is no
+  // burn-in and the relative change is taken per iteration
+  double rel = fabs((a - _prev_h) / _prev_h);
+  double tol = 0.0000001;
+  uint32_t burnin = 2000;
+  if (_blambda) {
+    rel /= (_iter > _prev_h_iter ? _iter - _prev_h_iter : 1);
+    tol = _env.stop_threshold;
+    burnin = 0;
+  }
+
   bool stop = false;
   int why = -1;
-  if (_iter > 2000) {
-    if (a > _prev_h && 
-	_prev_h != 0 && fabs((a - _prev_h) / _prev_h) < 0.0000001) {
+  if (_iter > burnin) {
+    if (a > _prev_h && _prev_h != 0 && rel < tol) {
       stop = true;
       why = 0;
     } else if (a < _prev_h)
@@ -383,6 +649,7 @@ MargInf::compute_likelihood(bool first, bool validation)
     }
   }
   _prev_h = a;
+  _prev_h_iter = _iter;
 
   if (stop) {
     double v = 0; //validation_likelihood();
@@ -405,6 +672,17 @@ MargInf::compute_likelihood(bool first, bool validation)
   return (s / k) / _n;
 }
 
+// heldout scores and save_beta() refit a locus from the batch fit's
+// lambda when there is one, else from a random lambda
+void
+MargInf::reset_pcomp(uint32_t loc)
+{
+  if (_blambda)
+    _pcomp.reset(loc, _blambda->const_data()[loc]);
+  else
+    _pcomp.reset(loc);
+}
+
 void
 MargInf::save_gamma()
 {
@@ -460,8 +738,8 @@ MargInf::save_beta()
     exit(-1);
   }
   for (uint32_t l = 0; l < _l; ++l) {
-    _pcomp.reset(l);
-    _pcomp.update_phis_until_conv();
+    reset_pcomp(l);
+    update_phis_until_conv();
     fprintf(f, "%d\t", l);
     fprintf(g, "%d\t", l);
     const Array &beta = _pcomp.beta();
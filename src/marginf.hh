@@ -11,6 +11,9 @@
 #include "matrix.hh"
 #include "lib.hh"
 #include "snp.hh"
+#include "thread.hh"
+#include "tsreduce.hh"
+#include "holike.hh"
 
 #include <gsl/gsl_rng.h>
 #include <gsl/gsl_randist.h>
@@ -35,7 +38,7 @@ public:
       _v(_k,_t), _phidad(_n,_k), _phimom(_n,_k),
       _phinext(_k), 
       _snp(snp), 
-      _lambda(_k,_t),
+      _lambda(_k,_t), _lambdat(_k,_t),
       _lambdaold(_k,_t), _Elogbeta(_k,_t), 
       _beta(_k), _eta(eta), _pop(pop)
   { }
@@ -43,6 +46,7 @@ public:
 
   int init_lambda();
   void reset(uint32_t loc);
+  void reset(uint32_t loc, const double * const *lambda);
   
   const Matrix& phimom() const { return _phimom; }
   const Matrix& phidad() const { return _phidad; }
@@ -53,9 +57,9 @@ public:
   uint32_t iter() const     { return _iter; }
 
   void update_phis_until_conv();
-  void update_phimom(uint32_t n);
-  void update_phidad(uint32_t n);
-  void update_lambda();
+  void update_phis(uint32_t first, uint32_t last,
+		   Array &phinext, Matrix &lambdat);
+  bool set_lambda(const Matrix &lambdat);
   double estimate_mean_rate(uint32_t k) const;
   void estimate_beta();
 
@@ -78,6 +82,7 @@ private:
   const SNP &_snp;
   
   Matrix _lambda;
+  Matrix _lambdat;
   Matrix _lambdaold;
   Matrix _Elogbeta;
   Array _beta;
@@ -86,15 +91,62 @@ private:
   const MargInf &_pop;
 };
 
+// a worker owns a contiguous range of individuals: their phis at the
+// current locus, their share of lambda_t and their gamma rows.  in
+// batch mode it also owns a range of loci, with its own locus state
+// and gamma statistics for the E-step
+class MargRunner : public Thread {
+public:
+  MargRunner(uint32_t idx, uint32_t first, uint32_t last,
+	     uint32_t lfirst, uint32_t llast,
+	     uint32_t n, uint32_t k, uint32_t t, MargInf &pop)
+    : _idx(idx), _first(first), _last(last),
+      _lfirst(lfirst), _llast(llast), _n(n), _k(k),
+      _phinext(k), _lambdat(k,t), _pop(pop),
+      _bpcomp(NULL), _stats(NULL) { }
+  ~MargRunner() { delete _bpcomp; delete _stats; }
+
+  int do_work();
+  const Matrix &lambdat() const { return _lambdat; }
+
+private:
+  void estep();
+
+  uint32_t _idx;
+  uint32_t _first;
+  uint32_t _last;
+  uint32_t _lfirst;
+  uint32_t _llast;
+  uint32_t _n;
+  uint32_t _k;
+  Array _phinext;
+  Matrix _lambdat;
+  MargInf &_pop;
+  MargPhiCompute *_bpcomp;
+  Matrix *_stats;
+};
+
 class MargInf {
 public:
   MargInf(Env &env, SNP &snp);
   ~MargInf();
 
   void infer();
+  void batch_infer();
   bool kv_ok(uint32_t indiv, uint32_t loc) const;
   void load_model(string betafile = "", string thetafile = "");
   void snp_likelihood(uint32_t loc, uint32_t n, Array &p);
+
+  enum { JOB_PHIS, JOB_GAMMA, JOB_ESTEP, JOB_MSTEP };
+  MargPhiCompute &pcomp() { return _pcomp; }
+  MargPhiCompute *new_pcomp();
+  int wait_job(uint32_t &gen);
+  void job_done();
+  void update_gamma(uint32_t first, uint32_t last);
+  void estep(uint32_t first, uint32_t last,
+	     MargPhiCompute &pc, Matrix &stats);
+  void mstep(uint32_t first, uint32_t last);
+  TSReduce &stats_reduce() { return *_stats_reduce; }
   
 
 private:
@@ -107,7 +159,13 @@ private:
   void save_gamma();
   void save_model();
 
+  int start_threads();
+  void init_batch();
+  void run_job(int job);
+  void update_phis_until_conv();
+
   double compute_likelihood(bool first, bool validation);
+  void reset_pcomp(uint32_t loc);
 
   void init_gamma();
   uint32_t duration() const;
@@ -176,8 +234,26 @@ private:
 
   double _max_t, _max_h, _max_v, _prev_h, _prev_w, _prev_t;
   mutable uint32_t _nh, _nt;
+  uint32_t _prev_h_iter;
   uint32_t _sampled_loc;
   uint64_t _total_locations;
+  HOLikelihood _holike;
+
+  // the worker pool, and the job the main thread last posted
+  vector<MargRunner *> _runners;
+  Matrix _lambdat;
+  CondMutex _job_cm;
+  uint32_t _job_gen;
+  int _job;
+  volatile uint32_t _job_left;
+  bool _job_ready;
+
+  // batch mode: each locus' lambda, carried over between iterations,
+  // and the gamma statistics sum_l (y phimom + (2 - y) phidad) of an
+  // E-step, reduced over the workers in a fixed order
+  D3 *_blambda;
+  Matrix *_stats;
+  TSReduce *_stats_reduce;
 };
 
 
@@ -194,6 +270,23 @@ MargPhiCompute::reset(uint32_t loc)
   init_lambda();
 }
 
+// starts from a given lambda rather than a random one
+inline void
+MargPhiCompute::reset(uint32_t loc, const double * const *lambda)
+{
+  _v.zero();
+  _phidad.zero();
+  _phimom.zero();
+  _lambdaold.zero();
+  _loc = loc;
+
+  double **ld = _lambda.data();
+  for (uint32_t k = 0; k < _k; ++k)
+    for (uint32_t t = 0; t < _t; ++t)
+      ld[k][t] = lambda[k][t];
+  PopLib::set_dir_exp(_lambda, _Elogbeta);
+}
+
 inline int
 MargPhiCompute::init_lambda()
 {
@@ -211,73 +304,64 @@ MargPhiCompute::init_lambda()
   return 0;
 }
 
+// phis of individuals [first, last) at the current locus, and their
+// part of lambda_t; phinext and lambdat belong to the caller, so
+// workers may run this concurrently on disjoint ranges
 inline void
-MargPhiCompute::update_lambda()
+MargPhiCompute::update_phis(uint32_t first, uint32_t last,
+			    Array &phinext, Matrix &lambdat)
 {
-  double **lambdad = _lambda.data();
-  double **phimomd = _phimom.data();
-  double **phidadd = _phidad.data();
-  const yval_t ** const snpd = _snp.y().data();
+  const double ** const elogthetad = _Elogtheta.const_data();
+  const double ** const elogbetad = _Elogbeta.const_data();
+  const yval_t ** const snpd = _snp.y().const_data();
+  double **ldt = lambdat.data();
 
-  for (uint32_t k = 0; k < _k; ++k) {
-    lambdad[k][0] = _env.eta0;
-    lambdad[k][1] = _env.eta1;
-    for (uint32_t i = 0; i < _n; ++i)  {
-      if (!_pop.kv_ok(i, _loc))
-	continue;
-      lambdad[k][0] += phimomd[i][k] * snpd[i][_loc];
-      lambdad[k][1] += phidadd[i][k] * (2 - snpd[i][_loc]);
-    }
+  for (uint32_t n = first; n < last; n++) {
+    if (!_pop.kv_ok(n, _loc))
+      continue;
+    yval_t y = snpd[n][_loc];
+
+    for (uint32_t k = 0; k < _k; ++k)
+      phinext[k] = elogthetad[n][k] + elogbetad[k][0];
+    phinext.lognormalize();
+    _phimom.set_elements(n, phinext);
+    for (uint32_t k = 0; k < _k; ++k)
+      ldt[k][0] += phinext[k] * y;
+
+    for (uint32_t k = 0; k < _k; ++k)
+      phinext[k] = elogthetad[n][k] + elogbetad[k][1];
+    phinext.lognormalize();
+    _phidad.set_elements(n, phinext);
+    for (uint32_t k = 0; k < _k; ++k)
+      ldt[k][1] += phinext[k] * (2 - y);
   }
-  PopLib::set_dir_exp(_lambda, _Elogbeta);
 }
 
-inline void
-MargPhiCompute::update_phimom(uint32_t n)
+// lambda from a complete lambda_t; true once it has settled
+inline bool
+MargPhiCompute::set_lambda(const Matrix &lambdat)
 {
-  //_phinext.zero();
-  const double ** const elogthetad = _Elogtheta.const_data();
-  const double ** const elogbetad = _Elogbeta.const_data();
-  for (uint32_t k = 0; k < _k; ++k)
-    _phinext[k] = elogthetad[n][k] + elogbetad[k][0];
-  _phinext.lognormalize();
-  _phimom.set_elements(n, _phinext);
-}
+  _lambdaold.copy_from(_lambda);
+  double **lambdad = _lambda.data();
+  const double ** const ldt = lambdat.const_data();
+  for (uint32_t k = 0; k < _k; ++k) {
+    lambdad[k][0] = _env.eta0 + ldt[k][0];
+    lambdad[k][1] = _env.eta1 + ldt[k][1];
+  }
+  PopLib::set_dir_exp(_lambda, _Elogbeta);
 
-inline void
-MargPhiCompute::update_phidad(uint32_t n)
-{
-  //_phinext.zero();
-  const double ** const elogthetad = _Elogtheta.const_data();
-  const double ** const elogbetad = _Elogbeta.const_data();
-  for (uint32_t k = 0; k < _k; ++k)
-    _phinext[k] = elogthetad[n][k] + elogbetad[k][1];
-  _phinext.lognormalize();
-  _phidad.set_elements(n, _phinext);
+  sub(_lambda, _lambdaold, _v);
+  tst("v = %s", _v.s().c_str());
+  return _v.abs_mean() < _env.meanchangethresh;
 }
 
 inline void
 MargPhiCompute::update_phis_until_conv()
 {
-  double u = 1./_k;
-  _phimom.set_elements(u);
-  _phidad.set_elements(u);
-
   for (uint32_t i = 0; i < _env.online_iterations; ++i) {
-    for (uint32_t n = 0; n < _n; n++) {
-      if (!_pop.kv_ok(n, _loc))
-	continue;
-      update_phimom(n);
-      update_phidad(n);
-    }
-    _lambdaold.copy_from(_lambda);
-    update_lambda();
-  
-    //_v.zero();
-    sub(_lambda, _lambdaold, _v);
-    tst("v = %s", _v.s().c_str());
-    
-    if (_v.abs_mean() < _env.meanchangethresh)
+    _lambdat.zero();
+    update_phis(0, _n, _phinext, _lambdat);
+    if (set_lambda(_lambdat))
       break;
   }
   estimate_beta();
@@ -338,41 +422,14 @@ MargInf::snp_likelihood(uint32_t loc, vector<uint32_t> &indivs, bool first)
   const double ** const thetad = _Etheta.const_data();
   const yval_t ** const snpd = _snp.y().const_data();
 
-  if (first) {
-    _pcomp.reset(loc);
+  reset_pcomp(loc);
+  if (first)
     _pcomp.estimate_beta();
-  } else {
-    _pcomp.reset(loc);
-    _pcomp.update_phis_until_conv();
-  }
+  else
+    update_phis_until_conv();
   const Array &beta = _pcomp.beta();
 
-  D1Array<yval_t> a(_n);
-  _snp.y().slice(1, loc, a);
-
-  double lsum = .0;
-  for (uint32_t i = 0; i < indivs.size(); ++i)  {
-    uint32_t n = indivs[i];
-    assert (!_snp.is_missing(n, loc));
-
-    double sum = .0;
-
-    yval_t x = snpd[n][loc];
-    double q = .0;
-    double v = gsl_sf_fact(2) / 
-      (gsl_sf_fact(x) * gsl_sf_fact(2 - x));
-    
-    for (uint32_t k = 0; k < _k; ++k)
-      q += beta[k] * thetad[n][k];
-    
-    sum = v * pow(q, x) *  pow(1 - q, 2 - x);
-    if (sum < 1e-30)
-      sum = 1e-30;
-    lsum += log(sum);
-  }
-
-
-
+  double lsum = _holike.score(thetad, beta.const_data(), indivs, snpd, loc);
   tst("logsum=%.5f\t%.5f\n", lsum / indivs.size(), exp(lsum / indivs.size()));
   return lsum;
 }
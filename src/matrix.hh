@@ -580,6 +580,7 @@ public:
   double dot(uint32_t i, uint32_t j);
   void zero();
   void zero(uint32_t a);
+  void realloc_row(uint32_t a);
   int copy_from(const D2Array<T> &a);
   int copy_from(uint32_t m, const D3Array<T> &a);
   int add_to(const D2Array<T> &a);
@@ -627,6 +628,18 @@ D2Array<T>::D2Array(const D2Array<T> &a)
   copy_from(a);
 }
 
+// move row a into memory allocated (and first touched) by the
+// calling thread
+template<class T> inline void
+D2Array<T>::realloc_row(uint32_t a)
+{
+  assert (a < _m);
+  T *p = new T[_n];
+  memcpy(p, _data[a], sizeof(T)*_n);
+  delete[] _data[a];
+  _data[a] = p;
+}
+
 template<class T> inline void
 D2Array<T>::set_elements(T v)
 {
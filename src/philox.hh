@@ -0,0 +1,132 @@
+#ifndef PHILOX_HH
+#define PHILOX_HH
+
+#include <stdint.h>
+#include <math.h>
+
+// counter-based random numbers: philox4x32-10 (Salmon et al., SC'11)
+//
+// a draw is a pure function of (key, counter), so any stream can be
+// recreated anywhere, by any thread, without carrying generator state
+// around.  the key is the run's seed; the upper three counter words
+// name the stream (domain, locus, individual) and the lowest one
+// counts blocks within it
+class Philox {
+public:
+  Philox(uint64_t seed, uint32_t domain, uint32_t loc, uint32_t idx);
+
+  double uniform();
+  uint32_t uniform_int(uint32_t n);
+  double normal();
+  double gamma(double a);
+  double beta(double a, double b);
+
+  static void block(const uint32_t ctr[4], const uint32_t key[2],
+		    uint32_t out[4]);
+
+private:
+  uint32_t next();
+
+  uint32_t _key[2];
+  uint32_t _ctr[4];
+  uint32_t _out[4];
+  uint32_t _used;
+};
+
+inline
+Philox::Philox(uint64_t seed, uint32_t domain, uint32_t loc, uint32_t idx)
+  : _used(4)
+{
+  _key[0] = (uint32_t)seed;
+  _key[1] = (uint32_t)(seed >> 32);
+  _ctr[0] = 0;
+  _ctr[1] = idx;
+  _ctr[2] = loc;
+  _ctr[3] = domain;
+}
+
+inline void
+Philox::block(const uint32_t ctr[4], const uint32_t key[2], uint32_t out[4])
+{
+  const uint32_t M0 = 0xD2511F53, M1 = 0xCD9E8D57;
+  const uint32_t W0 = 0x9E3779B9, W1 = 0xBB67AE85;
+  uint32_t c0 = ctr[0], c1 = ctr[1], c2 = ctr[2], c3 = ctr[3];
+  uint32_t k0 = key[0], k1 = key[1];
+  for (uint32_t r = 0; r < 10; ++r) {
+    uint64_t p0 = (uint64_t)M0 * c0;
+    uint64_t p1 = (uint64_t)M1 * c2;
+    uint32_t n0 = (uint32_t)(p1 >> 32) ^ c1 ^ k0;
+    uint32_t n1 = (uint32_t)p1;
+    uint32_t n2 = (uint32_t)(p0 >> 32) ^ c3 ^ k1;
+    uint32_t n3 = (uint32_t)p0;
+    c0 = n0; c1 = n1; c2 = n2; c3 = n3;
+    k0 += W0; k1 += W1;
+  }
+  out[0] = c0; out[1] = c1; out[2] = c2; out[3] = c3;
+}
+
+inline uint32_t
+Philox::next()
+{
+  if (_used == 4) {
+    block(_ctr, _key, _out);
+    _ctr[0]++;
+    _used = 0;
+  }
+  return _out[_used++];
+}
+
+// 53 bits, strictly inside (0,1)
+inline double
+Philox::uniform()
+{
+  uint32_t a = next() >> 5, b = next() >> 6;
+  return (a * 67108864.0 + b + 0.5) / 9007199254740992.0;
+}
+
+inline uint32_t
+Philox::uniform_int(uint32_t n)
+{
+  uint32_t v = (uint32_t)(uniform() * n);
+  return v < n ? v : n - 1;
+}
+
+inline double
+Philox::normal()
+{
+  double u1 = uniform(), u2 = uniform();
+  return sqrt(-2.0 * log(u1)) * cos(2 * M_PI * u2);
+}
+
+// Marsaglia and Tsang, with the usual boost for a < 1
+inline double
+Philox::gamma(double a)
+{
+  if (a < 1) {
+    double u = uniform();
+    return gamma(1.0 + a) * pow(u, 1.0 / a);
+  }
+  double d = a - 1.0 / 3, c = 1.0 / sqrt(9 * d);
+  while (1) {
+    double x, v;
+    do {
+      x = normal();
+      v = 1 + c * x;
+    } while (v <= 0);
+    v = v * v * v;
+    double u = uniform();
+    if (u < 1 - 0.0331 * x * x * x * x)
+      return d * v;
+    if (log(u) < 0.5 * x * x + d * (1 - v + log(v)))
+      return d * v;
+  }
+}
+
+inline double
+Philox::beta(double a, double b)
+{
+  double x = gamma(a), y = gamma(b);
+  return x / (x + y);
+}
+
+#endif
@@ -0,0 +1,264 @@
+#include "project.hh"
+#include "log.hh"
+
+Project::Project(Env &env, SNP &snp)
+  : _env(env), _snp(snp),
+    _n(env.n), _k(env.k), _l(env.l),
+    _start_time(time(0)),
+    _beta(_l,_k), _gamma(_n,_k), _Etheta(_n,_k),
+    _missing(_n), _sweeps(0), _nconv(0)
+{
+  if (_env.simulation) {
+    lerr("-project needs a genotype file");
+    exit(-1);
+  }
+  load_beta();
+  init_missing();
+}
+
+// a beta.txt row is the locus followed by its K frequencies
+void
+Project::load_beta()
+{
+  const string &s = _env.project;
+  FILE *f = fopen(s.c_str(), "r");
+  if (!f)  {
+    lerr("cannot open beta file %s:%s\n", s.c_str(), strerror(errno));
+    exit(-1);
+  }
+
+  double **betad = _beta.data();
+  bool bin = s.length() > 4 && s.substr(s.length() - 4) == ".bin";
+  uint32_t nread = 0;
+  if (bin) {
+    for (; nread < _l; ++nread)
+      if (fread(betad[nread], sizeof(double), _k, f) != _k)
+	break;
+  } else {
+    vector<bool> seen(_l, false);
+    uint32_t loc = 0;
+    while (fscanf(f, "%d", &loc) == 1) {
+      if (loc >= _l || seen[loc]) {
+	lerr("bad or repeated locus %d in beta file %s", loc, s.c_str());
+	exit(-1);
+      }
+      for (uint32_t k = 0; k < _k; ++k)
+	if (fscanf(f, "%lf", &betad[loc][k]) != 1) {
+	  lerr("error parsing beta file %s at locus %d", s.c_str(), loc);
+	  exit(-1);
+	}
+      seen[loc] = true;
+      nread++;
+    }
+  }
+  fclose(f);
+  if (nread != _l) {
+    lerr("beta file %s has %d of %d loci", s.c_str(), nread, _l);
+    exit(-1);
+  }
+
+  // a frequency of 0 or 1 would make some genotype impossible under
+  // every population
+  for (uint32_t loc = 0; loc < _l; ++loc)
+    for (uint32_t k = 0; k < _k; ++k) {
+      if (betad[loc][k] < 1e-6)
+	betad[loc][k] = 1e-6;
+      else if (betad[loc][k] > 1 - 1e-6)
+	betad[loc][k] = 1 - 1e-6;
+    }
+  lerr("loaded beta for %d loci from %s", _l, s.c_str());
+}
+
+void
+Project::init_missing()
+{
+  const map<KV, bool> &m = _snp.missing_snps();
+  for (map<KV, bool>::const_iterator i = m.begin(); i != m.end(); ++i)
+    _missing[i->first.first].push_back((uint32_t)i->first.second);
+}
+
+void
+Project::infer()
+{
+  uint32_t nt = _env.nthreads < _n ? _env.nthreads : _n;
+  if (nt <= 1)
+    fit(0, _n);
+  else {
+    Thread::static_initialize();
+    vector<ProjectRunner *> runners;
+    uint32_t c = (_n + nt - 1) / nt;
+    for (uint32_t first = 0; first < _n; first += c) {
+      uint32_t last = first + c < _n ? first + c : _n;
+      ProjectRunner *t = new ProjectRunner(first, last, *this);
+      if (t->create() < 0) {
+	lerr("cannot create projection thread");
+	exit(-1);
+      }
+      runners.push_back(t);
+    }
+    for (uint32_t i = 0; i < runners.size(); ++i) {
+      runners[i]->join();
+      delete runners[i];
+    }
+  }
+
+  lerr("projected %d individuals in %d secs, %.1f sweeps on average, "
+       "%d converged", _n, duration(), (double)_sweeps / _n, _nconv);
+  Env::plog("projection secs", duration());
+  save_gamma();
+}
+
+int
+ProjectRunner::do_work()
+{
+  _pop.fit(_first, _last);
+  return 0;
+}
+
+// coordinate ascent on gamma for individuals [first, last):
+//   gamma_nk = alpha + sum_l y phi_mom_lk + (2 - y) phi_dad_lk
+// with phi_mom_l proportional to exp(Elogtheta_n) beta_l and phi_dad_l
+// to exp(Elogtheta_n) (1 - beta_l).  an individual stops once its
+// theta moves less than project_tol
+void
+Project::fit(uint32_t first, uint32_t last)
+{
+  uint32_t m = last - first;
+  Matrix et(m,_k);
+  Matrix acc(m,_k);
+  Array w(_k);
+  Array theta(_k);
+  vector<uint32_t> mpos(m);
+  vector<bool> active(m, true);
+  uint32_t nactive = m;
+  uint64_t sweeps = 0;
+
+  const double ** const betad = _beta.const_data();
+  const yval_t ** const yd = _snp.y().const_data();
+  double **gd = _gamma.data();
+  double **td = _Etheta.data();
+  double **etd = et.data();
+  double **accd = acc.data();
+
+  // the first sweep starts from uniform theta
+  for (uint32_t n = first; n < last; ++n)
+    for (uint32_t k = 0; k < _k; ++k) {
+      gd[n][k] = _env.alpha + 2.0 * _l / _k;
+      td[n][k] = 1.0 / _k;
+    }
+
+  for (uint32_t x = 0; x < _env.project_sweeps && nactive > 0; ++x) {
+    for (uint32_t i = 0; i < m; ++i) {
+      if (!active[i])
+	continue;
+      uint32_t n = first + i;
+      double s = .0;
+      for (uint32_t k = 0; k < _k; ++k)
+	s += gd[n][k];
+      double psi_sum = gsl_sf_psi(s);
+      for (uint32_t k = 0; k < _k; ++k)
+	etd[i][k] = exp(gsl_sf_psi(gd[n][k]) - psi_sum);
+      mpos[i] = 0;
+    }
+    acc.zero();
+
+    for (uint32_t l0 = 0; l0 < _l; l0 += LOCUS_BLOCK) {
+      uint32_t l1 = l0 + LOCUS_BLOCK < _l ? l0 + LOCUS_BLOCK : _l;
+      for (uint32_t i = 0; i < m; ++i) {
+	if (!active[i])
+	  continue;
+	uint32_t n = first + i;
+	const yval_t *y = yd[n];
+	const vector<uint32_t> &miss = _missing[n];
+	const double *e = etd[i];
+	double *a = accd[i];
+	for (uint32_t l = l0; l < l1; ++l) {
+	  if (mpos[i] < miss.size() && miss[mpos[i]] == l) {
+	    mpos[i]++;
+	    continue;
+	  }
+	  const double *b = betad[l];
+	  if (y[l] > 0) {
+	    double s = .0;
+	    for (uint32_t k = 0; k < _k; ++k) {
+	      w[k] = e[k] * b[k];
+	      s += w[k];
+	    }
+	    double c = y[l] / s;
+	    for (uint32_t k = 0; k < _k; ++k)
+	      a[k] += c * w[k];
+	  }
+	  if (y[l] < 2) {
+	    double s = .0;
+	    for (uint32_t k = 0; k < _k; ++k) {
+	      w[k] = e[k] * (1 - b[k]);
+	      s += w[k];
+	    }
+	    double c = (2 - y[l]) / s;
+	    for (uint32_t k = 0; k < _k; ++k)
+	      a[k] += c * w[k];
+	  }
+	}
+      }
+    }
+
+    for (uint32_t i = 0; i < m; ++i) {
+      if (!active[i])
+	continue;
+      uint32_t n = first + i;
+      double s = .0;
+      for (uint32_t k = 0; k < _k; ++k) {
+	gd[n][k] = _env.alpha + accd[i][k];
+	s += gd[n][k];
+      }
+      double change = .0;
+      for (uint32_t k = 0; k < _k; ++k) {
+	theta[k] = gd[n][k] / s;
+	change += fabs(theta[k] - td[n][k]);
+	td[n][k] = theta[k];
+      }
+      sweeps++;
+      if (change / _k < _env.project_tol) {
+	active[i] = false;
+	nactive--;
+      }
+    }
+  }
+  __sync_fetch_and_add(&_sweeps, sweeps);
+  __sync_fetch_and_add(&_nconv, m - nactive);
+}
+
+// same layout as the engines' gamma.txt and theta.txt
+void
+Project::save_gamma()
+{
+  FILE *f = fopen(Env::file_str("/gamma.txt").c_str(), "w");
+  FILE *g = fopen(Env::file_str("/theta.txt").c_str(), "w");
+  if (!f || !g)  {
+    lerr("cannot open gamma/theta file:%s\n",  strerror(errno));
+    exit(-1);
+  }
+  double **gd = _gamma.data();
+  double **td = _Etheta.data();
+  for (uint32_t n = 0; n < _n; ++n) {
+    string s = _snp.label(n);
+    if (s == "")
+      s = "unknown";
+    fprintf(f, "%d\t%s\t", n, s.c_str());
+    fprintf(g, "%d\t%s\t", n, s.c_str());
+    double max = .0;
+    uint32_t max_k = 0;
+    for (uint32_t k = 0; k < _k; ++k) {
+      fprintf(f, "%.8f\t", gd[n][k]);
+      fprintf(g, "%.8f\t", td[n][k]);
+      if (gd[n][k] > max) {
+	max = gd[n][k];
+	max_k = k;
+      }
+    }
+    fprintf(f,"%d\n", max_k);
+    fprintf(g,"%d\n", max_k);
+  }
+  fclose(f);
+  fclose(g);
+}
@@ -0,0 +1,81 @@
+#ifndef PROJECT_HH
+#define PROJECT_HH
+
+#include <vector>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdint.h>
+
+#include "env.hh"
+#include "matrix.hh"
+#include "lib.hh"
+#include "snp.hh"
+#include "thread.hh"
+
+#include <gsl/gsl_sf_psi.h>
+
+class Project;
+
+// a worker owns a contiguous range of the new individuals and fits
+// their gamma start to finish; it shares nothing but the fixed beta
+class ProjectRunner : public Thread {
+public:
+  ProjectRunner(uint32_t first, uint32_t last, Project &pop)
+    : _first(first), _last(last), _pop(pop) { }
+
+  int do_work();
+
+private:
+  uint32_t _first;
+  uint32_t _last;
+  Project &_pop;
+};
+
+// -project: infer the ancestry of new individuals against a trained
+// beta, read from beta.txt or from a binary L x K array of doubles
+// (".bin", as written by terastructure-sim).  with beta fixed the
+// individuals are independent: each one's gamma is fitted by
+// coordinate ascent, a sweep over the loci per update.  loci are
+// swept in blocks, and a worker runs all of its individuals over a
+// block while that block of beta is in cache
+class Project {
+public:
+  Project(Env &env, SNP &snp);
+  ~Project() { }
+
+  void infer();
+  void fit(uint32_t first, uint32_t last);
+
+  static const uint32_t LOCUS_BLOCK = 1024;
+
+private:
+  void load_beta();
+  void init_missing();
+  void save_gamma();
+  uint32_t duration() const;
+
+  Env &_env;
+  SNP &_snp;
+  uint32_t _n;
+  uint32_t _k;
+  uint32_t _l;
+  time_t _start_time;
+
+  Matrix _beta;
+  Matrix _gamma;
+  Matrix _Etheta;
+
+  // each individual's missing loci, in increasing order
+  vector< vector<uint32_t> > _missing;
+  uint64_t _sweeps;
+  uint32_t _nconv;
+};
+
+inline uint32_t
+Project::duration() const
+{
+  time_t t = time(0);
+  return t - _start_time;
+}
+
+#endif
@@ -0,0 +1,438 @@
+#include "thread.hh"
+#include "philox.hh"
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include <string>
+#include <vector>
+
+using namespace std;
+
+// terastructure-sim: standalone admixture simulator
+//
+// draws N admixture proportions (two-level dirichlet, as in -sim1),
+// L x K allele frequencies (balding-nichols) and the N x L genotypes,
+// and writes them as plink .bed/.bim/.fam plus the truth matrices
+// <prefix>.theta.bin (N x K) and <prefix>.beta.bin (L x K), row-major
+// native doubles.  every value comes from its own philox stream, so
+// the output does not depend on -nthreads
+
+// philox stream domains; beta and genotype streams match BigSim, so
+// with -hgdp the loci are those of an in-process -G run with the same
+// seed
+static const uint32_t BETA_STREAM = 1;
+static const uint32_t GENO_STREAM = 2;
+static const uint32_t THETA_STREAM = 3;
+static const uint32_t POPMIX_STREAM = 4;
+
+struct SimParams {
+  uint32_t n, l, k;
+  uint64_t seed;
+  double fst;
+  double dir_alpha;
+  double dir_gamma;
+  uint32_t blocksize;
+  vector<double> hgdp_fst;
+  vector<double> hgdp_af;
+};
+
+// loci are generated in batches; workers fill batch slots in a ring,
+// the main thread drains them in locus order
+class SimOut {
+public:
+  SimOut(const SimParams &p, uint32_t nslots, uint32_t batch);
+  ~SimOut();
+
+  uint32_t nbatches() const { return _nbatches; }
+  uint32_t batch() const { return _batch; }
+  uint32_t bytes_per_snp() const { return _bps; }
+  uint8_t *bed(uint32_t b) { return _bed + (size_t)(b % _nslots) * _batch * _bps; }
+  double *beta(uint32_t b) { return _beta + (size_t)(b % _nslots) * _batch * _p.k; }
+
+  void wait_free(uint32_t b);
+  void set_ready(uint32_t b);
+  void wait_ready(uint32_t b);
+  void set_written(uint32_t b);
+
+private:
+  const SimParams &_p;
+  uint32_t _nslots;
+  uint32_t _batch;
+  uint32_t _nbatches;
+  uint32_t _bps;
+  uint8_t *_bed;
+  double *_beta;
+  vector<uint32_t> _ready;
+  uint32_t _written;
+  CondMutex _cm;
+};
+
+SimOut::SimOut(const SimParams &p, uint32_t nslots, uint32_t batch)
+  : _p(p), _nslots(nslots), _batch(batch),
+    _nbatches((p.l + batch - 1) / batch),
+    _bps((p.n + 3) / 4),
+    _ready(nslots, 0),
+    _written(0)
+{
+  _bed = new uint8_t[(size_t)_nslots * _batch * _bps];
+  _beta = new double[(size_t)_nslots * _batch * _p.k];
+}
+
+SimOut::~SimOut()
+{
+  delete[] _bed;
+  delete[] _beta;
+}
+
+// a slot is free once the batch nslots before b has been written
+void
+SimOut::wait_free(uint32_t b)
+{
+  _cm.lock();
+  while (_written + _nslots <= b)
+    _cm.wait();
+  _cm.unlock();
+}
+
+void
+SimOut::set_ready(uint32_t b)
+{
+  _cm.lock();
+  _ready[b % _nslots] = b + 1;
+  _cm.broadcast();
+  _cm.unlock();
+}
+
+void
+SimOut::wait_ready(uint32_t b)
+{
+  _cm.lock();
+  while (_ready[b % _nslots] != b + 1)
+    _cm.wait();
+  _cm.unlock();
+}
+
+void
+SimOut::set_written(uint32_t b)
+{
+  _cm.lock();
+  _written = b + 1;
+  _cm.broadcast();
+  _cm.unlock();
+}
+
+class SimWorker : public Thread {
+public:
+  SimWorker(const SimParams &p, const double *theta, SimOut &out,
+	    uint32_t idx, uint32_t nworkers)
+    : _p(p), _theta(theta), _out(out), _idx(idx), _nworkers(nworkers),
+      _g(p.k) { }
+  int do_work();
+
+private:
+  void beta_row(uint32_t loc, double *g);
+  void genotypes(uint32_t loc, const double *g, uint8_t *bed);
+
+  const SimParams &_p;
+  const double *_theta;
+  SimOut &_out;
+  uint32_t _idx;
+  uint32_t _nworkers;
+  vector<double> _g;
+};
+
+int
+SimWorker::do_work()
+{
+  for (uint32_t b = _idx; b < _out.nbatches(); b += _nworkers) {
+    _out.wait_free(b);
+    uint8_t *bed = _out.bed(b);
+    double *beta = _out.beta(b);
+    uint32_t first = b * _out.batch();
+    uint32_t last = first + _out.batch();
+    if (last > _p.l)
+      last = _p.l;
+    for (uint32_t loc = first; loc < last; ++loc) {
+      double *g = beta + (size_t)(loc - first) * _p.k;
+      beta_row(loc, g);
+      genotypes(loc, g, bed + (size_t)(loc - first) * _out.bytes_per_snp());
+    }
+    _out.set_ready(b);
+  }
+  return 0;
+}
+
+// balding-nichols: one Beta draw per population around an ancestral
+// frequency, either a random hgdp (fst, af) row or af ~ U(0.05, 0.95)
+// with a fixed fst
+void
+SimWorker::beta_row(uint32_t loc, double *g)
+{
+  Philox r(_p.seed, BETA_STREAM, loc, 0);
+  double fst = _p.fst, af;
+  if (_p.hgdp_fst.size() > 0) {
+    uint32_t index = r.uniform_int(_p.hgdp_fst.size());
+    fst = _p.hgdp_fst[index];
+    af = _p.hgdp_af[index];
+  } else
+    af = 0.05 + 0.9 * r.uniform();
+  if (fst < 1e-6) {
+    for (uint32_t k = 0; k < _p.k; k++)
+      g[k] = af;
+    return;
+  }
+  double bp0 = af * (1 - fst) / fst;
+  double bp1 = (1 - af) * (1 - fst) / fst;
+  for (uint32_t k = 0; k < _p.k; k++)
+    g[k] = r.beta(bp0, bp1);
+}
+
+// plink snp-major packing, four individuals per byte, low bits
+// first: 00 = hom. a1 (y=0), 10 = het (y=1), 11 = hom. a2 (y=2)
+void
+SimWorker::genotypes(uint32_t loc, const double *g, uint8_t *bed)
+{
+  static const uint8_t code[3] = { 0x0, 0x2, 0x3 };
+  memset(bed, 0, _out.bytes_per_snp());
+  for (uint32_t i = 0; i < _p.n; ++i) {
+    const double *th = _theta + (size_t)i * _p.k;
+    double p = .0;
+    for (uint32_t k = 0; k < _p.k; ++k)
+      p += g[k] * th[k];
+    // binomial(2, p) by inverting the cdf, as BigSim::binomial2
+    double u = Philox(_p.seed, GENO_STREAM, loc, i).uniform();
+    double p2 = p * p;
+    uint32_t y = (u < p2) ? 2 : ((u < p2 + 2 * p * (1 - p)) ? 1 : 0);
+    bed[i >> 2] |= code[y] << (2 * (i & 3));
+  }
+}
+
+static void
+dirichlet(Philox &r, uint32_t k, const double *alpha, double *out)
+{
+  double s = .0;
+  for (uint32_t j = 0; j < k; ++j) {
+    out[j] = r.gamma(alpha[j]);
+    s += out[j];
+  }
+  for (uint32_t j = 0; j < k; ++j)
+    out[j] /= s;
+}
+
+// each block of individuals shares a mixing distribution drawn from
+// Dir(alpha); individuals are Dir(gamma * mix), floored at 1e-6
+static void
+draw_theta(const SimParams &p, double *theta)
+{
+  vector<double> alpha(p.k, p.dir_alpha), mix(p.k), param(p.k), tmp(p.k);
+  double offset = 1e-6 / (1 - (p.k * 1e-6));
+  double newsum = 1 + (p.k * offset);
+  for (uint32_t i = 0; i < p.n; ++i) {
+    if (i % p.blocksize == 0) {
+      Philox r(p.seed, POPMIX_STREAM, i / p.blocksize, 0);
+      dirichlet(r, p.k, alpha.data(), mix.data());
+      for (uint32_t k = 0; k < p.k; ++k)
+	param[k] = mix[k] * p.dir_gamma;
+    }
+    Philox r(p.seed, THETA_STREAM, 0, i);
+    dirichlet(r, p.k, param.data(), tmp.data());
+    for (uint32_t k = 0; k < p.k; ++k)
+      theta[(size_t)i * p.k + k] = (tmp[k] + offset) / newsum;
+  }
+}
+
+static int
+read_hgdp(string fname, SimParams &p)
+{
+  FILE *f = fopen(fname.c_str(), "r");
+  if (!f) {
+    fprintf(stderr, "error: cannot open %s\n", fname.c_str());
+    return -1;
+  }
+  double fstin, afin;
+  while (fscanf(f, "%lf %lf\n", &fstin, &afin) == 2) {
+    p.hgdp_fst.push_back(fstin);
+    p.hgdp_af.push_back(afin);
+  }
+  fclose(f);
+  if (p.hgdp_fst.size() == 0) {
+    fprintf(stderr, "error: no (fst, af) rows in %s\n", fname.c_str());
+    return -1;
+  }
+  return 0;
+}
+
+static FILE *
+open_out(string fname)
+{
+  FILE *f = fopen(fname.c_str(), "wb");
+  if (!f) {
+    fprintf(stderr, "error: cannot open %s for writing\n", fname.c_str());
+    exit(-1);
+  }
+  return f;
+}
+
+static void
+usage()
+{
+  fprintf(stdout, "Simulate admixed genotypes as a PLINK bed/bim/fam dataset.\n"
+	  "terastructure-sim [OPTIONS]\n"
+	  "\t-help\t\t usage\n"
+	  "\t-n <N>\t\t number of individuals\n"
+	  "\t-l <L>\t\t number of locations\n"
+	  "\t-k <K>\t\t number of populations\n"
+	  "\t-o <prefix>\t output prefix (default: sim)\n"
+	  "\t-seed <s>\t random seed\n"
+	  "\t-nthreads <T>\t number of generator threads\n"
+	  "\t-hgdp <file>\t draw (Fst, af) from rows of this file\n"
+	  "\t-fst <f>\t Fst when no -hgdp file is given (default: 0.1)\n"
+	  "\t-alpha <a>\t outer dirichlet parameter (default: 0.2)\n"
+	  "\t-gamma <g>\t inner dirichlet concentration (default: 50)\n"
+	  "\t-blocks <B>\t number of individual blocks sharing a mixture (default: 50)\n"
+	  "\t-batch <b>\t loci per generator batch (default: 1024)\n");
+  fflush(stdout);
+}
+
+int
+main(int argc, char **argv)
+{
+  SimParams p;
+  p.n = 0;
+  p.l = 0;
+  p.k = 0;
+  p.seed = 0;
+  p.fst = 0.1;
+  p.dir_alpha = 0.2;
+  p.dir_gamma = 50.0;
+  string prefix = "sim";
+  string hgdp = "";
+  uint32_t nthreads = 6;
+  uint32_t nblocks = 50;
+  uint32_t batch = 1024;
+
+  for (int i = 1; i < argc; ++i) {
+    if (strcmp(argv[i], "-help") == 0) {
+      usage();
+      exit(0);
+    } else if (i + 1 > argc - 1) {
+      fprintf(stderr, "+ insufficient arguments!\n");
+      exit(-1);
+    } else if (strcmp(argv[i], "-n") == 0) {
+      p.n = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "-l") == 0) {
+      p.l = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "-k") == 0) {
+      p.k = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "-o") == 0) {
+      prefix = string(argv[++i]);
+    } else if (strcmp(argv[i], "-seed") == 0) {
+      p.seed = (uint64_t)atof(argv[++i]);
+    } else if (strcmp(argv[i], "-nthreads") == 0) {
+      nthreads = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "-hgdp") == 0) {
+      hgdp = string(argv[++i]);
+    } else if (strcmp(argv[i], "-fst") == 0) {
+      p.fst = atof(argv[++i]);
+    } else if (strcmp(argv[i], "-alpha") == 0) {
+      p.dir_alpha = atof(argv[++i]);
+    } else if (strcmp(argv[i], "-gamma") == 0) {
+      p.dir_gamma = atof(argv[++i]);
+    } else if (strcmp(argv[i], "-blocks") == 0) {
+      nblocks = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "-batch") == 0) {
+      batch = atoi(argv[++i]);
+    } else {
+      fprintf(stdout, "error: unknown option %s\n", argv[i]);
+      usage();
+      exit(-1);
+    }
+  }
+
+  if (p.n == 0 || p.l == 0 || p.k == 0) {
+    fprintf(stderr, "error: -n, -l and -k are required\n");
+    usage();
+    exit(-1);
+  }
+  if (nthreads == 0)
+    nthreads = 1;
+  if (batch == 0)
+    batch = 1;
+  if (nblocks == 0 || nblocks > p.n)
+    nblocks = p.n;
+  p.blocksize = (p.n + nblocks - 1) / nblocks;
+  if (hgdp != "" && read_hgdp(hgdp, p) < 0)
+    exit(-1);
+
+  fprintf(stdout, "+ simulating (%d,%d) snps, K = %d, %d threads\n",
+	  p.n, p.l, p.k, nthreads);
+  fflush(stdout);
+
+  double *theta = new double[(size_t)p.n * p.k];
+  draw_theta(p, theta);
+
+  FILE *f = open_out(prefix + ".theta.bin");
+  fwrite(theta, sizeof(double), (size_t)p.n * p.k, f);
+  fclose(f);
+
+  f = open_out(prefix + ".fam");
+  for (uint32_t i = 0; i < p.n; ++i)
+    fprintf(f, "%d %d 0 0 0 -9\n", i + 1, i + 1);
+  fclose(f);
+
+  Thread::static_initialize();
+  SimOut out(p, 2 * nthreads, batch);
+  vector<SimWorker *> workers;
+  for (uint32_t t = 0; t < nthreads; ++t) {
+    SimWorker *w = new SimWorker(p, theta, out, t, nthreads);
+    if (w->create() < 0) {
+      fprintf(stderr, "error: failed to create thread\n");
+      exit(-1);
+    }
+    workers.push_back(w);
+  }
+
+  FILE *bedf = open_out(prefix + ".bed");
+  FILE *bimf = open_out(prefix + ".bim");
+  FILE *betaf = open_out(prefix + ".beta.bin");
+  static const uint8_t magic[3] = { 108, 27, 1 };
+  fwrite(magic, 1, 3, bedf);
+
+  for (uint32_t b = 0; b < out.nbatches(); ++b) {
+    out.wait_ready(b);
+    uint32_t first = b * batch;
+    uint32_t nloc = (first + batch > p.l) ? p.l - first : batch;
+    if (fwrite(out.bed(b), out.bytes_per_snp(), nloc, bedf) != nloc ||
+	fwrite(out.beta(b), sizeof(double) * p.k, nloc, betaf) != nloc) {
+      fprintf(stderr, "error: write failed\n");
+      exit(-1);
+    }
+    for (uint32_t loc = first; loc < first + nloc; ++loc)
+      fprintf(bimf, "1\tsnp%d\t0\t%d\tA\tC\n", loc + 1, loc + 1);
+    out.set_written(b);
+  }
+
+  for (uint32_t t = 0; t < nthreads; ++t) {
+    workers[t]->join();
+    delete workers[t];
+  }
+  Thread::static_uninitialize();
+  fclose(bedf);
+  fclose(bimf);
+  fclose(betaf);
+
+  f = open_out(prefix + ".sim.txt");
+  fprintf(f, "n\t%d\nl\t%d\nk\t%d\nseed\t%llu\n",
+	  p.n, p.l, p.k, (unsigned long long)p.seed);
+  fclose(f);
+  delete[] theta;
+
+  fprintf(stdout, "+ wrote %s.bed, %s.bim, %s.fam, %s.theta.bin, %s.beta.bin\n",
+	  prefix.c_str(), prefix.c_str(), prefix.c_str(),
+	  prefix.c_str(), prefix.c_str());
+  fflush(stdout);
+  return 0;
+}
@@ -258,7 +258,7 @@ SNP::read_bed(string s)
 
   fclose(bed_f);
   fclose(maff);
-
+  return 0;
 }
 
 int
@@ -500,54 +500,57 @@ SNP::sim2(){
 
 
 void
-BigSim::sim_set_y(uint32_t loc, uint32_t block, YArray &y)
+BigSim::sim_set_y(uint32_t loc, uint32_t block, YArray &y) const
 {
-  double **Gd = _G.data();
-  double **Sd = _S.data();
-  IDMap::const_iterator itr = _loc_to_idx.find(loc);
-  if (itr == _loc_to_idx.end()) {
-    uint32_t x = gsl_rng_uniform_int(_snp._r, _env.l);
-    _loc_to_idx[loc] = x;
-    itr = _loc_to_idx.find(loc);
-  }
-
-  uint32_t idx = itr->second;
+  Array g(_env.k);
+  beta_row(loc, g.data());
   uint32_t sz = _env.n / _env.blocks;
   uint32_t pos = block * sz;
-  debug("simulating individuals %d to %d for location %d", pos, pos + sz, loc);
-  for (uint32_t i = pos; i < pos + sz; i++) {
-    double marg_af = 0.0;
-    for(uint32_t k = 0; k < _env.k; k++)
-      marg_af += Gd[idx][k] * Sd[i][k];
-    y[i] = (yval_t) gsl_ran_binomial(_snp._r, marg_af, 2);
-  }
-  debug("done simulating");
+  sim_set_y(g.const_data(), loc, pos, pos + sz, y);
 }
 
 void
-BigSim::sim_set_y(uint32_t loc, YArray &y)
+BigSim::sim_set_y(uint32_t loc, YArray &y) const
 {
-  double **Gd = _G.data();
-  double **Sd = _S.data();
-  IDMap::const_iterator itr = _loc_to_idx.find(loc);
-  if (itr == _loc_to_idx.end()) {
-    uint32_t x = gsl_rng_uniform_int(_snp._r, _env.l);
-    _loc_to_idx[loc] = x;
-    itr = _loc_to_idx.find(loc);
-  }
-  uint32_t idx = itr->second;
+  Array g(_env.k);
+  beta_row(loc, g.data());
+  sim_set_y(g.const_data(), loc, 0, _env.n, y);
+}
 
-  gsl_rng_set(_snp._r, loc+32767); // XXX
-  
-  debug("simulating individuals %d to %d for location %d", pos, pos + sz, loc);
-  for (uint32_t i = 0; i < _env.n; i++) {
+// allele frequencies of a locus in each population: a random hgdp
+// row, then one Beta draw per population under the Balding-Nichols
+// model
+void
+BigSim::beta_row(uint32_t loc, double *g) const
+{
+  Philox r(_seed, BETA_STREAM, loc, 0);
+  uint32_t index = r.uniform_int(_fst.size());
+  if (_fst[index] < 1e-6) {
+    for (uint32_t k = 0; k < _env.k; k++)
+      g[k] = _af[index];
+    return;
+  }
+  double bp0 = _af[index] * (1 - _fst[index]) / _fst[index];
+  double bp1 = (1 - _af[index]) * (1 - _fst[index]) / _fst[index];
+  for (uint32_t k = 0; k < _env.k; k++)
+    g[k] = r.beta(bp0, bp1);
+}
+
+// genotypes of individuals [first, last); each one has its own
+// stream, so the result does not depend on how the range is split
+void
+BigSim::sim_set_y(const double *g, uint32_t loc, 
+		  uint32_t first, uint32_t last, YArray &y) const
+{
+  const double ** const Sd = _S.const_data();
+  debug("simulating individuals %d to %d for location %d", first, last, loc);
+  for (uint32_t i = first; i < last; i++) {
     double marg_af = 0.0;
     for(uint32_t k = 0; k < _env.k; k++)
-      marg_af += Gd[idx][k] * Sd[i][k];
-    debug("loc:%d, n:%d, marg_af:%.5f", loc, i, marg_af);
-    y[i] = (yval_t) gsl_ran_binomial(_snp._r, marg_af, 2);
+      marg_af += g[k] * Sd[i][k];
+    Philox r(_seed, GENO_STREAM, loc, i);
+    y[i] = binomial2(marg_af, r.uniform());
   }
-  debug("done simulating");
 }
 
 //sim based off reading the fitted betas
@@ -558,7 +561,8 @@ BigSim::sim()
   fflush(stdout);
 
   //read in fitted betas
-  double **Gd = _G.data();
+  Matrix G(L, _env.k);
+  double **Gd = G.data();
 
   FILE *f = fopen("TGP_1718_k6_beta.txt", "r");
   if (!f) {
@@ -636,12 +640,7 @@ BigSim::sim1()
   fprintf(stdout, "+ BigSim sim1: simulating (%d,%d) snps\n", _env.n, _env.l);
   fflush(stdout);
 
-  //read in fitted betas
-  double **Gd = _G.data();
-
   //need to read in the Fst and allele freqs from hgdp
-  vector<double> fst;
-  vector<double> af;
   double fstin, afin;
   
   FILE *f = fopen("hgdp_BN.txt", "r");
@@ -654,31 +653,13 @@ BigSim::sim1()
       printf("Error: BN simulation input\n");
       exit(-1);
     }
-    fst.push_back(fstin);
-    af.push_back(afin);
+    _fst.push_back(fstin);
+    _af.push_back(afin);
   }
   fclose(f);
   lerr("done reading file");
 
-  //populate G
-  uint32_t index;
-  double bp0, bp1;
-
-  for(uint32_t i = 0; i < _env.l; i++) {
-    index = gsl_rng_uniform_int(_snp._r, BigSim::HGDP_size);
-    if(fst[index] < 1e-6) {
-      for(uint32_t k = 0; k < _env.k; k++) {
-        Gd[i][k] = af[index];
-      }
-    }
-    else {
-      bp0 = af[index] * (1-fst[index])/fst[index];
-      bp1 = (1-af[index]) * (1-fst[index])/fst[index];
-      for(uint32_t k = 0; k < _env.k; k++) {
-        Gd[i][k] = gsl_ran_beta(_snp._r, bp0, bp1);
-      }
-    }
-  }
+  // G is no longer populated up front; see beta_row()
 
   //simulation parameters currently hardcoded
   uint32_t blocksize = _env.n/50; //250; //block size of outer dirichlet
@@ -728,13 +709,16 @@ BigSim::sim1()
 
   //output betas
   f = fopen(_env.file_str("/G_out.txt").c_str(), "w");
+  Array g(_env.k);
   for(uint32_t i = 0; i < _env.l; i++) {
+    beta_row(i, g.data());
     for(uint32_t k = 0; k < _env.k; k++) {
-      fprintf(f, "%.6f ", Gd[i][k]);
+      fprintf(f, "%.6f ", g[k]);
     }
     fprintf(f, "\n");
   }
   fclose(f);
+  return 0;
 }
 
 
@@ -9,6 +9,7 @@
 #include "matrix.hh"
 #include "env.hh"
 #include "lib.hh"
+#include "philox.hh"
 #include <string.h>
 
 #include <gsl/gsl_rng.h>
@@ -26,17 +27,26 @@ public:
   BigSim(SNP &snp, Env &env):
     _snp(snp),
     _env(env),
-    _G(env.l, env.k),
+    _seed((uint64_t)env.seed),
     _S(env.n, env.k) { }
   ~BigSim() { }
 
-  const Matrix &G() const { return _G; }
   const Matrix &S() const { return _S; }
 
   int sim();
   int sim1();
-  void sim_set_y(uint32_t loc, uint32_t block, YArray &y);
-  void sim_set_y(uint32_t loc, YArray &y);
+  void sim_set_y(uint32_t loc, uint32_t block, YArray &y) const;
+  void sim_set_y(uint32_t loc, YArray &y) const;
+
+  // pure functions of (seed, locus[, individual]); thread-safe
+  void beta_row(uint32_t loc, double *g) const;
+  void sim_set_y(const double *g, uint32_t loc, 
+		 uint32_t first, uint32_t last, YArray &y) const;
+  static yval_t binomial2(double p, double u);
+  
+  // philox stream domains
+  static const uint32_t BETA_STREAM = 1;
+  static const uint32_t GENO_STREAM = 2;
   
   static const uint32_t L = 1854622;
   static const uint32_t HGDP_size = 430775;
@@ -45,10 +55,13 @@ private:
   SNP &_snp;
   Env &_env;
 
-  // simulation state
-  Matrix _G;
+  // simulation state; a locus' allele frequencies and genotypes are
+  // regenerated on demand, so only the admixture proportions and
+  // the hgdp (fst, af) table stay resident
+  uint64_t _seed;
   Matrix _S;
-  IDMap _loc_to_idx;
+  vector<double> _fst;
+  vector<double> _af;
 };
 
 class SNP {
@@ -101,6 +114,19 @@ private:
   friend class BigSim;
 };
 
+// Binomial(2, p) from a single uniform by inverting its cdf:
+// P(2) = p^2, P(1) = 2p(1-p), P(0) = (1-p)^2
+inline yval_t
+BigSim::binomial2(double p, double u)
+{
+  double p2 = p * p;
+  if (u < p2)
+    return 2;
+  if (u < p2 + 2 * p * (1 - p))
+    return 1;
+  return 0;
+}
+
 inline
 SNP::SNP(Env &env):
   _env(env),
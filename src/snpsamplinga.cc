@@ -27,7 +27,8 @@ SNPSamplingA::SNPSamplingA(Env &env, SNP &snp)
    _prev_t(-2147483647),
    _nh(0), _nt(0),
    _sampled_loc(0),
-   _total_locations(0)
+   _total_locations(0),
+   _holike(_k)
 {
   printf("+ popinf initialization begin\n");
   fflush(stdout);
@@ -11,6 +11,7 @@
 #include "matrix.hh"
 #include "lib.hh"
 #include "snp.hh"
+#include "holike.hh"
 
 #include <gsl/gsl_rng.h>
 #include <gsl/gsl_randist.h>
@@ -179,6 +180,7 @@ private:
   mutable uint32_t _nh, _nt;
   uint32_t _sampled_loc;
   uint64_t _total_locations;
+  HOLikelihood _holike;
 };
 
 
@@ -370,32 +372,7 @@ SNPSamplingA::snp_likelihood(uint32_t loc, vector<uint32_t> &indivs, bool first)
   }
   const Array &beta = _pcomp.beta();
 
-  D1Array<yval_t> a(_n);
-  _snp.y().slice(1, loc, a);
-
-  double lsum = .0;
-  for (uint32_t i = 0; i < indivs.size(); ++i)  {
-    uint32_t n = indivs[i];
-    assert (!_snp.is_missing(n, loc));
-
-    double sum = .0;
-
-    yval_t x = snpd[n][loc];
-    double q = .0;
-    double v = gsl_sf_fact(2) / 
-      (gsl_sf_fact(x) * gsl_sf_fact(2 - x));
-    
-    for (uint32_t k = 0; k < _k; ++k)
-      q += beta[k] * thetad[n][k];
-    
-    sum = v * pow(q, x) *  pow(1 - q, 2 - x);
-    if (sum < 1e-30)
-      sum = 1e-30;
-    lsum += log(sum);
-  }
-
-
-
+  double lsum = _holike.score(thetad, beta.const_data(), indivs, snpd, loc);
   tst("logsum=%.5f\t%.5f\n", lsum / indivs.size(), exp(lsum / indivs.size()));
   return lsum;
 }
@@ -30,7 +30,8 @@ SNPSamplingB::SNPSamplingB(Env &env, SNP &snp)
    _prev_t(-2147483647),
    _nh(0), _nt(0),
    _sampled_loc(0),
-   _total_locations(0)
+   _total_locations(0),
+   _holike(_k)
 {
   if (_env.adagrad) {
     _gamma_ag = new Matrix(_n,_k);
@@ -11,6 +11,7 @@
 #include "matrix.hh"
 #include "lib.hh"
 #include "snp.hh"
+#include "holike.hh"
 
 #include <gsl/gsl_rng.h>
 #include <gsl/gsl_randist.h>
@@ -184,6 +185,7 @@ private:
   mutable uint32_t _nh, _nt;
   uint32_t _sampled_loc;
   uint64_t _total_locations;
+  HOLikelihood _holike;
 };
 
 inline void
@@ -274,32 +276,10 @@ SNPSamplingB::snp_likelihood(uint32_t loc, vector<uint32_t> &indivs, bool first)
   const double ** const betad = _Ebeta.const_data();
   const yval_t ** const snpd = _snp.y().const_data();
 
-  D1Array<yval_t> a(_n);
-  _snp.y().slice(1, loc, a);
-
   if (first)
     estimate_beta(loc);
 
-  double lsum = .0;
-  for (uint32_t i = 0; i < indivs.size(); ++i)  {
-    uint32_t n = indivs[i];
-    assert (!_snp.is_missing(n, loc));
-
-    double sum = .0;
-
-    yval_t x = snpd[n][loc];
-    double q = .0;
-    double v = gsl_sf_fact(2) / 
-      (gsl_sf_fact(x) * gsl_sf_fact(2 - x));
-    
-    for (uint32_t k = 0; k < _k; ++k)
-      q += betad[loc][k] * thetad[n][k];
-    
-    sum = v * pow(q, x) *  pow(1 - q, 2 - x);
-    if (sum < 1e-30)
-      sum = 1e-30;
-    lsum += log(sum);
-  }
+  double lsum = _holike.score(thetad, betad[loc], indivs, snpd, loc);
   tst("logsum=%.5f\t%.5f\n", lsum / indivs.size(), exp(lsum / indivs.size()));
   return lsum;
 }
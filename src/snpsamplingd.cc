@@ -1,7 +1,6 @@
 #include "snpsamplingd.hh"
 #include "log.hh"
 #include <sys/time.h>
-#include <gsl/gsl_histogram.h>
 
 SNPSamplingD::SNPSamplingD(Env &env, SNP &snp)
   :_env(env), _snp(snp),
@@ -9,6 +8,9 @@ SNPSamplingD::SNPSamplingD(Env &env, SNP &snp)
    _t(env.t), _nthreads(_env.nthreads),
    _iter(0), _alpha(_k), _loc(0),
    _eta(_k,_t),
+   _loc_sampler(NULL),
+   _loc_sched(NULL),
+   _block(0), _cv_nblocks(0),
    _gamma(_n,_k), 
    _lambda(_l,_k,_t),
    _lambdat(_k,_t),
@@ -16,8 +18,12 @@ SNPSamplingD::SNPSamplingD(Env &env, SNP &snp)
    _nodetau0(env.nodetau0 + 1), _nodekappa(env.nodekappa),
    _rho_indiv(_n), _rho_loc(_l),
    _c_indiv(_n), _c_loc(_l),
+   _rho_indiv_table(env.nodetau0 + 1, env.nodekappa),
+   _rho_loc_table(env.tau0 + 1, env.kappa),
+   _adapt_rho(NULL),
    _nodeupdatec(_n),
    _start_time(time(0)),
+   _elbo(NULL),
    _Elogtheta(_n,_k),
    _Elogbeta(_l,_k,_t),
    _Etheta(_n,_k),
@@ -34,8 +40,12 @@ SNPSamplingD::SNPSamplingD(Env &env, SNP &snp)
    _init_phase(true),
    _phidad(_n,_k), _phimom(_n,_k),
    _phinext(_k), _lambdaold(_k,_t),
-   _v(_k,_t)
+   _v(_k,_t),
+   _holike(_k)
 {
+  if (_env.adaptive_rho)
+    _adapt_rho = new AdaptiveRho(_n, _k);
+
   printf("+ popinf initialization begin\n");
   fflush(stdout);
 
@@ -97,6 +107,16 @@ SNPSamplingD::SNPSamplingD(Env &env, SNP &snp)
   }
 
   init_heldout_sets();
+  if (_env.maf_sampling && _env.epoch_block > 0) {
+    lerr("error: -maf-sampling does not combine with -epoch-block");
+    exit(-1);
+  }
+  if (_env.maf_sampling)
+    init_loc_sampler();
+  if (_env.epoch_block > 0)
+    _loc_sched = new LocusSchedule(_l, _env.epoch_block);
+  if (_env.saga)
+    init_cv();
   
   info("+ initializing gamma\n");
   init_gamma();
@@ -140,6 +160,12 @@ SNPSamplingD::~SNPSamplingD()
   fclose(_vf);
   fclose(_tf);
   fclose(_lf);
+  delete _elbo;
+  delete _adapt_rho;
+  delete _loc_sampler;
+  delete _loc_sched;
+  for (uint32_t l = 0; l < _loc_cv.size(); ++l)
+    delete _loc_cv[l];
   fclose(_tef);
   fclose(_vef);
 }
@@ -299,6 +325,7 @@ SNPSamplingD::get_subsample()
   // get subsample of individuals
   double v = (double)(gsl_rng_uniform_int(_r, _n)) / _env.indiv_sample_size;
   uint32_t q = ((int)v) * _env.indiv_sample_size;
+  _block = (uint32_t)v;
   _indivs.clear();
   while (_indivs.size() < _env.indiv_sample_size) {
     uint32_t n = _shuffled_nodes[q];
@@ -310,47 +337,46 @@ SNPSamplingD::get_subsample()
     q = (q + 1) % _n;
     continue;
   }
-  // XXX
-  // get_subsample_nonuniform();
-  // exit(0);
 }
 
+// proposal over loci: half uniform, half in proportion to the
+// heterozygosity 2p(1-p) at the locus' minor allele frequency p;
+// near-monomorphic loci say little about ancestry, and the uniform
+// half keeps every locus reachable with weight at most 2L
 void
-SNPSamplingD::get_subsample_nonuniform()
+SNPSamplingD::init_loc_sampler()
 {
-  size_t  bins = 10;
-  double offset = 0.05;
-  Array range(bins+1);
-  double c = 0;
-  for (uint32_t i = 0; i <= bins; i++) {
-    range[i] = offset * i;
-    c += range[i];
+  vector<double> w(_l);
+  double hsum = .0;
+  for (uint32_t l = 0; l < _l; ++l) {
+    double p = _snp.maf(l);
+    w[l] = 2 * p * (1 - p);
+    hsum += w[l];
   }
-  debug("range = %s", range.s().c_str());
-  
-  gsl_histogram* hist = gsl_histogram_alloc(bins);
-  assert( hist != NULL );
-  gsl_histogram_set_ranges(hist, range.data(), bins+1);
-
-  for(int l = 0; l < _l; ++l )
-    gsl_histogram_increment (hist, _snp.maf(l));
-
-  // Create the histogram pdf
-  gsl_histogram_pdf*  histpdf = gsl_histogram_pdf_alloc (bins);
-  assert( histpdf != NULL );
-  int status = gsl_histogram_pdf_init (histpdf, hist);
-  assert( status != GSL_EDOM );
-
-  Array v(100);
-  for (uint32_t i = 0; i < 100; ++i)
-    v[i] = gsl_histogram_pdf_sample(histpdf,gsl_rng_uniform(_r));
-  debug("v = %s", v.s().c_str());
+  if (hsum <= 0) {
+    lerr("error: all loci are monomorphic; -maf-sampling needs allele frequencies\n");
+    exit(-1);
+  }
+  for (uint32_t l = 0; l < _l; ++l)
+    w[l] = 0.5 / _l + 0.5 * w[l] / hsum;
+  _loc_sampler = new AliasTable(w);
+
+  double wmin = loc_weight(0), wmax = wmin;
+  for (uint32_t l = 1; l < _l; ++l) {
+    double v = loc_weight(l);
+    if (v < wmin)
+      wmin = v;
+    if (v > wmax)
+      wmax = v;
+  }
+  Env::plog("min locus weight", wmin);
+  Env::plog("max locus weight", wmax);
 }
 
 void
 SNPSamplingD::update_rho_indiv(uint32_t n)
 {
-  _rho_indiv[n] = pow(_nodetau0 + _c_indiv[n], -1 * _nodekappa);
+  _rho_indiv[n] = _rho_indiv_table(_c_indiv[n]);
   _c_indiv[n]++;
   if (n == 30) {
     debug("rho indiv = %f", _rho_indiv[n]);
@@ -360,7 +386,7 @@ SNPSamplingD::update_rho_indiv(uint32_t n)
 void
 SNPSamplingD::update_rho_loc(uint32_t l)
 {
-  _rho_loc[l] = pow(_tau0 + _c_loc[l], -1 * _kappa);
+  _rho_loc[l] = _rho_loc_table(_c_loc[l]);
   _c_loc[l]++;
 }
 
@@ -375,6 +401,11 @@ SNPSamplingD::update_lambda()
   double **ld = _lambda.data()[_loc];
   double **ldt = _lambdat.data();
     
+  if (_env.saga && !_init_phase) {
+    cv_estimate(_loc, _block, lambda_scale);
+    lambda_scale = 1.0;
+  }
+
   update_rho_loc(_loc);
   for (uint32_t k = 0; k < _k; ++k) {
     if (!_init_phase) {
@@ -390,6 +421,54 @@ SNPSamplingD::update_lambda()
   //lerr("lambda = %s", _lambda.s(_loc).c_str());
 }
 
+// a minibatch is a block of indiv_sample_size consecutive
+// individuals in _shuffled_nodes, the last block possibly shorter
+void
+SNPSamplingD::init_cv()
+{
+  uint32_t b = _env.indiv_sample_size;
+  _cv_nblocks = (_n - 1) / b + 1;
+  _cv_pblock.resize(_cv_nblocks);
+  for (uint32_t i = 0; i < _cv_nblocks; ++i) {
+    uint32_t last = (i + 1) * b < _n ? (i + 1) * b : _n;
+    _cv_pblock[i] = (double)(last - i * b) / _n;
+  }
+  _loc_cv.resize(_l, NULL);
+  Env::plog("saga blocks", _cv_nblocks);
+  Env::plog("saga MB if every locus is visited",
+	    (double)_l * _cv_nblocks * _k * _t * sizeof(float) / (1 << 20));
+}
+
+// SAGA control variate on the scaled lambda_t of block b,
+//   a_b + (mean - stale_b)
+// has the expectation of a_b over blocks whatever the stale entries
+// hold, so it applies from a locus' first visit with the unseen
+// blocks' entries at zero; it cancels most of the between-block noise
+// once the phis change slowly.  negative corrected counts are clipped
+// so lambda stays positive
+void
+SNPSamplingD::cv_estimate(uint32_t loc, uint32_t b, double scale)
+{
+  LocCV *cv = _loc_cv[loc];
+  if (!cv) {
+    cv = new LocCV(_cv_nblocks, _k);
+    _loc_cv[loc] = cv;
+  }
+  double **ldt = _lambdat.data();
+  float *stale = &cv->stale[b * _k * _t];
+  for (uint32_t k = 0; k < _k; ++k)
+    for (uint32_t t = 0; t < _t; ++t) {
+      uint32_t i = k * _t + t;
+      float a = scale * ldt[k][t];
+      double old = stale[i];
+      ldt[k][t] = a + cv->mean[i] - old;
+      if (ldt[k][t] < 0)
+	ldt[k][t] = 0;
+      cv->mean[i] += _cv_pblock[b] * (a - old);
+      stale[i] = a;
+    }
+}
+
 void
 SNPSamplingD::estimate_beta()
 {
@@ -534,6 +613,8 @@ SNPSamplingD::infer_init_phase()
       compute_likelihood(false, true);
       if (_env.use_test_set)
 	compute_likelihood(false, false);
+      if (_env.compute_logl)
+	logl();
       lerr("saving theta @ %d secs", duration());
       save_model();
       lerr("done @ %d secs", duration());
@@ -561,7 +642,7 @@ SNPSamplingD::infer()
   lerr("MAIN PHASE BEGIN");
   uint64_t threads_used = 0;
   while (1) {
-    _loc = gsl_rng_uniform_int(_r, _l);
+    _loc = next_loc();
     const yval_t ** const snpd = _snp.y().const_data();
     get_subsample();
 
@@ -641,10 +722,14 @@ SNPSamplingD::infer()
       lerr("iteration = %d took %d secs, mean threads used %.2f\n", 
 	   _iter, duration(), (double)threads_used / _iter);
       fflush(stdout);
+      if (_loc_sched)
+	lerr("locus epoch %d", _loc_sched->epoch());
       lerr("computing heldout likelihood @ %d secs", duration());
       compute_likelihood(false, true);
       if (_env.use_test_set)
 	compute_likelihood(false, false);
+      if (_env.compute_logl)
+	logl();
       lerr("saving theta @ %d secs", duration());
       save_model();
       lerr("done @ %d secs", duration());
@@ -789,6 +874,23 @@ SNPSamplingD::add_iter_suffix(const char *c)
   return Env::file_str(sa.str());
 }
 
+// variational bound over the training pairs, or an unbiased
+// estimate from -elbo-loci sampled loci
+double
+SNPSamplingD::logl()
+{
+  if (!_elbo)
+    _elbo = new ELBO<SNPSamplingD>(_env, *this, _nthreads);
+  double p1, p2, p3;
+  double s = _elbo->compute(_env.elbo_loci, p1, p2, p3);
+
+  info("approx. log likelihood = %f\n", s);
+  fprintf(_lf, "%d\t%d\t%.5f\t%.5f\t%.5f\t%.5f\n", 
+	  _iter, duration(), s, p1, p2, p3);
+  fflush(_lf);
+  return s;
+}
+
 void
 SNPSamplingD::save_model()
 {
@@ -1086,7 +1188,7 @@ PhiRunner2::update_gamma(const IndivsList &indivs)
   const double **phimomd = _phimom.const_data();
   const yval_t ** const snpd = _snp.y().const_data();
 
-  double gamma_scale = _env.l;
+  double gamma_scale = _pop.loc_weight(_loc);
   double **gd = _pop.gamma().data();
 
   // no locking needed
@@ -1096,12 +1198,20 @@ PhiRunner2::update_gamma(const IndivsList &indivs)
     if (!_pop.kv_ok(n, _loc))
       continue;
     
-    _pop.update_rho_indiv(n);
     yval_t y = snpd[n][_loc];
-    for (uint32_t k = 0; k < _k; ++k) {
-      gd[n][k] += _pop.rho_indiv(n) * \ 
-	(_pop.alpha(k) + (gamma_scale * (y * phimomd[n][k] + (2 - y) * phidadd[n][k])) - gd[n][k]);
+    double *g = _phinext.data();
+    for (uint32_t k = 0; k < _k; ++k)
+      g[k] = _pop.alpha(k) + (gamma_scale * (y * phimomd[n][k] + (2 - y) * phidadd[n][k])) - gd[n][k];
+
+    double rho;
+    if (_pop.adaptive_rho())
+      rho = _pop.adaptive_rho(n, g);
+    else {
+      _pop.update_rho_indiv(n);
+      rho = _pop.rho_indiv(n);
     }
+    for (uint32_t k = 0; k < _k; ++k)
+      gd[n][k] += rho * g[k];
   }
 }
 
@@ -13,6 +13,11 @@
 #include "snp.hh"
 #include "thread.hh"
 #include "tsqueue.hh"
+#include "holike.hh"
+#include "elbo.hh"
+#include "stepsize.hh"
+#include "alias.hh"
+#include "locsched.hh"
 
 #include <gsl/gsl_rng.h>
 #include <gsl/gsl_randist.h>
@@ -21,6 +26,17 @@
 
 typedef vector<uint32_t> IndivsList;
 typedef std::map<uint32_t, IndivsList *> ChunkMap;
+
+// -saga state of one locus, allocated on its first visit: the last
+// scaled lambda_t seen from each block of individuals (zero for a
+// block not seen yet), kept in single precision, and their mean
+// weighted by the blocks' sampling probabilities
+struct LocCV {
+  LocCV(uint32_t nblocks, uint32_t k)
+    : mean(2 * k, .0), stale(nblocks * 2 * k, .0f) { }
+  vector<double> mean;
+  vector<float> stale;
+};
 class SNPSamplingD;
 class PhiRunner2 : public Thread {
 public:
@@ -122,12 +138,17 @@ public:
   D3 &lambda()     { return _lambda; }
   Matrix &Etheta()  { return _Etheta; }
   Matrix &Elogtheta()  { return _Elogtheta; }
+  void fill_y(uint32_t loc, YArray &y) const;
 
   void update_rho_indiv(uint32_t n);
   void update_rho_loc(uint32_t l);
 
   const double alpha(uint32_t k) const     { return _alpha[k]; }
+  const Matrix &eta() const { return _eta; }
   const double rho_indiv(uint32_t n) const { return _rho_indiv[n]; }
+  bool adaptive_rho() const { return _adapt_rho != NULL; }
+  double adaptive_rho(uint32_t n, const double *g) { return _adapt_rho->next(n, g); }
+  double loc_weight(uint32_t loc) const;
 
 private:
   void init_heldout_sets();
@@ -159,7 +180,10 @@ private:
   void update_lambda();
 
   void get_subsample();
-  void get_subsample_nonuniform();
+  void init_cv();
+  void cv_estimate(uint32_t loc, uint32_t block, double scale);
+  void init_loc_sampler();
+  uint32_t next_loc();
   uint32_t duration() const;
 
   void estimate_beta();
@@ -197,6 +221,13 @@ private:
   vector<uint32_t> _heldout_loc;
   vector<uint32_t> _validation_loc;
   gsl_rng *_r;
+  AliasTable *_loc_sampler;
+  LocusSchedule *_loc_sched;
+
+  uint32_t _block;
+  uint32_t _cv_nblocks;
+  vector<double> _cv_pblock;
+  vector<LocCV *> _loc_cv;
 
   Matrix _gamma;
   D3 _lambda;
@@ -211,6 +242,9 @@ private:
   Array _rho_loc;
   uArray _c_indiv;
   uArray _c_loc;
+  RhoTable _rho_indiv_table;
+  RhoTable _rho_loc_table;
+  AdaptiveRho *_adapt_rho;
   
   double _rhot;
   double _noderhot;
@@ -220,6 +254,7 @@ private:
   time_t _start_time;
   struct timeval _last_iter;
   FILE *_lf;
+  ELBO<SNPSamplingD> *_elbo;
 
   Matrix _Elogtheta;
   D3 _Elogbeta;
@@ -254,6 +289,7 @@ private:
   Array _phinext;
   Matrix _lambdaold;
   Matrix _v;
+  HOLikelihood _holike;
 };
 
 inline void
@@ -331,34 +367,12 @@ SNPSamplingD::snp_likelihood(uint32_t loc, vector<uint32_t> &indivs, bool first)
   const double ** const betad = _Ebeta.const_data();
   const yval_t ** const snpd = _snp.y().const_data();
 
-  D1Array<yval_t> a(_n);
-  _snp.y().slice(1, loc, a);
-
   if (first)
     estimate_beta(loc);
   else
     update_phis_until_conv(loc);
 
-  double lsum = .0;
-  for (uint32_t i = 0; i < indivs.size(); ++i)  {
-    uint32_t n = indivs[i];
-    assert (!_snp.is_missing(n, loc));
-
-    double sum = .0;
-
-    yval_t x = snpd[n][loc];
-    double q = .0;
-    double v = gsl_sf_fact(2) / 
-      (gsl_sf_fact(x) * gsl_sf_fact(2 - x));
-    
-    for (uint32_t k = 0; k < _k; ++k)
-      q += betad[loc][k] * thetad[n][k];
-    
-    sum = v * pow(q, x) *  pow(1 - q, 2 - x);
-    if (sum < 1e-30)
-      sum = 1e-30;
-    lsum += log(sum);
-  }
+  double lsum = _holike.score(thetad, betad[loc], indivs, snpd, loc);
   tst("logsum=%.5f\t%.5f\n", lsum / indivs.size(), exp(lsum / indivs.size()));
   return lsum;
 }
@@ -410,6 +424,38 @@ SNPSamplingD::kv_ok(uint32_t indiv, uint32_t loc) const
   return true;
 }
 
+// genotypes of one locus, as G gets them from the simulator
+inline void
+SNPSamplingD::fill_y(uint32_t loc, YArray &y) const
+{
+  const yval_t ** const snpd = _snp.y().const_data();
+  for (uint32_t n = 0; n < _n; ++n)
+    y[n] = snpd[n][loc];
+}
+
+// training loci are drawn uniformly, or with -maf-sampling from
+// the alias table
+inline uint32_t
+SNPSamplingD::next_loc()
+{
+  if (_loc_sched)
+    return _loc_sched->next(_r);
+  if (!_loc_sampler)
+    return gsl_rng_uniform_int(_r, _l);
+  return _loc_sampler->sample(_r);
+}
+
+// importance weight of a training locus: gamma's noisy gradient
+// scales a locus' term by 1 / P(loc), which is L under uniform
+// sampling
+inline double
+SNPSamplingD::loc_weight(uint32_t loc) const
+{
+  if (!_loc_sampler)
+    return _l;
+  return 1.0 / _loc_sampler->prob(loc);
+}
+
 inline double
 SNPSamplingD::logcoeff(yval_t x) {
   uint32_t c = 2;
@@ -18,6 +18,8 @@ SNPSamplingE::SNPSamplingE(Env &env, SNP &snp)
    _c_indiv(_n),
    _nodeupdatec(_n),
    _start_time(time(0)),
+   _elbo(NULL),
+   _loc_sched(NULL),
    _Elogtheta(_n,_k),
    _Elogbeta(_l,_k,_t),
    _Etheta(_n,_k),
@@ -34,7 +36,8 @@ SNPSamplingE::SNPSamplingE(Env &env, SNP &snp)
    _hol_mode(false),
    _phidad(_n,_k), _phimom(_n,_k),
    _phinext(_k), _lambdaold(_k,_t),
-   _v(_k,_t)
+   _v(_k,_t),
+   _holike(_k)
 {
   printf("+ popinf initialization begin\n");
   fflush(stdout);
@@ -119,6 +122,8 @@ SNPSamplingE::SNPSamplingE(Env &env, SNP &snp)
   }
 
   init_heldout_sets();
+  if (_env.epoch_block > 0)
+    _loc_sched = new LocusSchedule(_l, _env.epoch_block);
   init_gamma();
   init_lambda();
 
@@ -153,6 +158,8 @@ SNPSamplingE::~SNPSamplingE()
   fclose(_vf);
   fclose(_tf);
   fclose(_lf);
+  delete _elbo;
+  delete _loc_sched;
   fclose(_tef);
   fclose(_vef);
 }
@@ -450,7 +457,7 @@ SNPSamplingE::infer()
   split_all_indivs();
 
   while (1) {
-    _loc = gsl_rng_uniform_int(_r, _l);
+    _loc = _loc_sched ? _loc_sched->next(_r) : gsl_rng_uniform_int(_r, _l);
     debug("LOC = %d", _loc);
     optimize_lambda(_loc);
     
@@ -472,10 +479,14 @@ SNPSamplingE::infer()
       printf("iteration = %d took %d secs\n", 
 	     _iter, duration());
       lerr("iteration = %d took %d secs\n", _iter, duration());
+      if (_loc_sched)
+	lerr("locus epoch %d", _loc_sched->epoch());
       lerr("computing heldout likelihood @ %d secs", duration());
       compute_likelihood(false, true);
       if (_env.use_test_set)
 	compute_likelihood(false, false);
+      if (_env.compute_logl)
+	logl();
       lerr("saving theta @ %d secs", duration());
       save_model();
       lerr("done @ %d secs", duration());
@@ -625,6 +636,23 @@ SNPSamplingE::add_iter_suffix(const char *c)
   return Env::file_str(sa.str());
 }
 
+// variational bound over the training pairs, or an unbiased
+// estimate from -elbo-loci sampled loci
+double
+SNPSamplingE::logl()
+{
+  if (!_elbo)
+    _elbo = new ELBO<SNPSamplingE>(_env, *this, _nthreads);
+  double p1, p2, p3;
+  double s = _elbo->compute(_env.elbo_loci, p1, p2, p3);
+
+  info("approx. log likelihood = %f\n", s);
+  fprintf(_lf, "%d\t%d\t%.5f\t%.5f\t%.5f\t%.5f\n", 
+	  _iter, duration(), s, p1, p2, p3);
+  fflush(_lf);
+  return s;
+}
+
 void
 SNPSamplingE::save_model()
 {
@@ -13,6 +13,9 @@
 #include "snp.hh"
 #include "thread.hh"
 #include "tsqueue.hh"
+#include "holike.hh"
+#include "elbo.hh"
+#include "locsched.hh"
 
 #include <gsl/gsl_rng.h>
 #include <gsl/gsl_randist.h>
@@ -125,9 +128,11 @@ public:
   D3 &lambda()     { return _lambda; }
   Matrix &Etheta()  { return _Etheta; }
   Matrix &Elogtheta()  { return _Elogtheta; }
+  void fill_y(uint32_t loc, YArray &y) const;
 
   void update_rho_indiv(uint32_t n);
   const double alpha(uint32_t k) const     { return _alpha[k]; }
+  const Matrix &eta() const { return _eta; }
   //const double rho_indiv() const { return _rho_indiv; }
   const double rho_indiv(uint32_t n) const { return _rho_indiv[n]; }
 
@@ -227,6 +232,8 @@ private:
   time_t _start_time;
   struct timeval _last_iter;
   FILE *_lf;
+  ELBO<SNPSamplingE> *_elbo;
+  LocusSchedule *_loc_sched;	// -epoch-block
 
   Matrix _Elogtheta;
   D3 _Elogbeta;
@@ -261,6 +268,7 @@ private:
   Array _phinext;
   Matrix _lambdaold;
   Matrix _v;
+  HOLikelihood _holike;
 };
 
 inline void
@@ -322,9 +330,6 @@ SNPSamplingE::duration() const
 inline double
 SNPSamplingE::snp_likelihood(uint32_t loc, vector<uint32_t> &indivs, bool first)
 {
-  D1Array<yval_t> a(_n);
-  _snp.y().slice(1, loc, a);
-
   if (first)
     estimate_beta(loc);
   else {
@@ -336,26 +341,7 @@ SNPSamplingE::snp_likelihood(uint32_t loc, vector<uint32_t> &indivs, bool first)
   const double ** const thetad = _Etheta.const_data();
   const double ** const betad = _Ebeta.const_data();
   const yval_t ** const snpd = _snp.y().const_data();
-  double lsum = .0;
-  for (uint32_t i = 0; i < indivs.size(); ++i)  {
-    uint32_t n = indivs[i];
-    assert (!_snp.is_missing(n, loc));
-
-    double sum = .0;
-
-    yval_t x = snpd[n][loc];
-    double q = .0;
-    double v = gsl_sf_fact(2) / 
-      (gsl_sf_fact(x) * gsl_sf_fact(2 - x));
-    
-    for (uint32_t k = 0; k < _k; ++k)
-      q += betad[loc][k] * thetad[n][k];
-    
-    sum = v * pow(q, x) *  pow(1 - q, 2 - x);
-    if (sum < 1e-30)
-      sum = 1e-30;
-    lsum += log(sum);
-  }
+  double lsum = _holike.score(thetad, betad[loc], indivs, snpd, loc);
   tst("logsum=%.5f\t%.5f\n", lsum / indivs.size(), exp(lsum / indivs.size()));
   return lsum;
 }
@@ -407,6 +393,15 @@ SNPSamplingE::kv_ok(uint32_t indiv, uint32_t loc) const
   return true;
 }
 
+// genotypes of one locus, as G gets them from the simulator
+inline void
+SNPSamplingE::fill_y(uint32_t loc, YArray &y) const
+{
+  const yval_t ** const snpd = _snp.y().const_data();
+  for (uint32_t n = 0; n < _n; ++n)
+    y[n] = snpd[n][loc];
+}
+
 inline double
 SNPSamplingE::logcoeff(yval_t x) {
   uint32_t c = 2;
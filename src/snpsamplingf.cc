@@ -36,7 +36,8 @@ SNPSamplingF::SNPSamplingF(Env &env, SNP &snp)
    _phinext(_k), _lambdaold(_k,_t),
    _v(_k,_t),
    _collisions(0),
-   _y(_env.n)
+   _y(_env.n),
+   _holike(_k)
 {
   printf("+ popinf initialization begin\n");
   fflush(stdout);
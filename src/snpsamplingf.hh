@@ -13,6 +13,7 @@
 #include "snp.hh"
 #include "thread.hh"
 #include "tsqueue.hh"
+#include "holike.hh"
 
 #include <gsl/gsl_rng.h>
 #include <gsl/gsl_randist.h>
@@ -263,6 +264,7 @@ private:
   LocIndivMap _loc_indiv_map;
   YArray _y;
   YArrayMap _heldout_loc_y;
+  HOLikelihood _holike;
 };
 
 inline void
@@ -335,26 +337,7 @@ SNPSamplingF::snp_likelihood(uint32_t loc, vector<uint32_t> &indivs, bool first)
 
   const yval_t * const snpd = y->const_data();
 
-  double lsum = .0;
-  for (uint32_t i = 0; i < indivs.size(); ++i)  {
-    uint32_t n = indivs[i];
-    assert (!_snp.is_missing(n, loc));
-
-    double sum = .0;
-
-    yval_t x = snpd[n];
-    double q = .0;
-    double v = gsl_sf_fact(2) / 
-      (gsl_sf_fact(x) * gsl_sf_fact(2 - x));
-    
-    for (uint32_t k = 0; k < _k; ++k)
-      q += betad[loc][k] * thetad[n][k];
-    
-    sum = v * pow(q, x) *  pow(1 - q, 2 - x);
-    if (sum < 1e-30)
-      sum = 1e-30;
-    lsum += log(sum);
-  }
+  double lsum = _holike.score(thetad, betad[loc], indivs, snpd);
   tst("logsum=%.5f\t%.5f\n", lsum / indivs.size(), exp(lsum / indivs.size()));
   return lsum;
 }
@@ -1,12 +1,14 @@
 #include "snpsamplingg.hh"
 #include "log.hh"
 #include <sys/time.h>
+#include <algorithm>
 #include <gsl/gsl_histogram.h>
 
 SNPSamplingG::SNPSamplingG(Env &env, SNP &snp)
   :_env(env), _snp(snp),
    _n(env.n), _k(env.k), _l(_env.l),
-   _t(env.t), _nthreads(_env.nthreads),
+   // at most one worker per individual, so every worker has a chunk
+   _t(env.t), _nthreads(_env.nthreads < env.n ? _env.nthreads : env.n),
    _iter(0), _alpha(_k), _loc(0),
    _eta(_k,_t),
    _gamma(_n,_k), 
@@ -16,8 +18,17 @@ SNPSamplingG::SNPSamplingG(Env &env, SNP &snp)
    _nodetau0(env.nodetau0 + 1), _nodekappa(env.nodekappa),
    _rho_indiv(_n),
    _c_indiv(_n),
+   _rho_indiv_table(env.nodetau0 + 1, env.nodekappa),
+   _adapt_rho(NULL),
+   _theta_age(NULL), _theta_drift(NULL),
+   _theta_exact(0), _theta_all(0),
+   _act_change(NULL), _frozen(NULL), _act_etheta(NULL),
+   _topm_idx(NULL),
+   _batch_beta(NULL), _batch_lambdat(NULL), _batch_first(false),
+   _loc_sched(NULL),
    _nodeupdatec(_n),
    _start_time(time(0)),
+   _elbo(NULL),
    _Elogtheta(_n,_k),
    _Elogbeta(_l,_k,_t),
    _Etheta(_n,_k),
@@ -31,13 +42,105 @@ SNPSamplingG::SNPSamplingG(Env &env, SNP &snp)
    _nh(0), _nt(0),
    _sampled_loc(0),
    _total_locations(0),
-   _hol_mode(false),
+   _tile_sched(_nthreads),
+   _lambdat_reduce(NULL),
+   _thf(NULL),
+   _lpf(NULL),
+   _nloci(0),
+   _last_report_loci(0),
+   _last_report_secs(0),
+   _gamma_pending(false),
+   _apply_gamma(false),
+   _gamma_loc(0),
+   _sim_pending(false),
+   _sim_y(false),
+   _sim_beta(_k),
    _phidad(_n,_k), _phimom(_n,_k),
    _phinext(_k), _lambdaold(_k,_t),
    _v(_k,_t),
    _y(new YArray(_env.n)),
-   _prev_y(new YArray(_env.n))
+   _prev_y(new YArray(_env.n)),
+   _loc_busy(NULL),
+   _async_pause(false),
+   _async_paused(0),
+   _hol_Etheta(_n,_k),
+   _hol_Elogtheta(_n,_k),
+   _hol_lambda(NULL),
+   _hol_first(false),
+   _hol_busy(false),
+   _hol_wanted(false),
+   _hol_ready(false),
+   _hol_gen(0),
+   _hol_next(0),
+   _hol_left(0),
+   _hol_iter(0),
+   _hol_secs(0),
+   _hol_nloci(0),
+   _sc_holike(_k),
+   _sc_draws(0),
+   _sc_nseen(0),
+   _sc_total(.0),
+   _sc_sweep_iter(0),
+   _sc_iter(0),
+   _scf(NULL),
+   _beta_next(0),
+   _incr_hold(0),
+   _incr_until(0)
 {
+  if (_env.adaptive_rho && _env.async_groups > 0) {
+    lerr("error: -adaptive-rho does not combine with -async-groups");
+    exit(-1);
+  }
+  if (_env.adaptive_rho)
+    _adapt_rho = new AdaptiveRho(_n, _k);
+  if (_env.lazy_theta > 0) {
+    _theta_age = new uArray(_n);
+    _theta_age->zero();
+    _theta_drift = new Array(_n);
+    _theta_drift->zero();
+  }
+  if (_env.active_set > 0) {
+    _act_change = new Array(_n);
+    _act_change->set_elements(1.0);
+    _frozen = new uint8_t[_n];
+    memset(_frozen, 0, _n);
+    _act_etheta = new Matrix(_n, _k);
+  }
+  if (_env.topm > 0) {
+    if (_env.topm >= _k) {
+      lerr("error: -topm %d needs fewer than k = %d populations",
+	   _env.topm, _k);
+      exit(-1);
+    }
+    if (_env.async_groups > 0 || _env.adaptive_rho ||
+	_env.lazy_theta > 0 || _env.active_set > 0) {
+      lerr("error: -topm does not combine with -async-groups, "
+	   "-adaptive-rho, -lazy-theta or -active-set");
+      exit(-1);
+    }
+  }
+  if (_env.locus_batch > 1) {
+    if (_env.async_groups > 0 || _env.topm > 0 || _env.active_set > 0 ||
+	_env.compute_beta) {
+      lerr("error: -locus-batch does not combine with -async-groups, "
+	   "-topm, -active-set or -compute-beta");
+      exit(-1);
+    }
+    init_batch();
+  }
+  if (_env.epoch_block > 0) {
+    if (_env.async_groups > 0) {
+      lerr("error: -epoch-block does not combine with -async-groups");
+      exit(-1);
+    }
+    _loc_sched = new LocusSchedule(_l, _env.epoch_block);
+  }
+  if (_env.incremental != "" && (_env.adaptive_rho || _env.compute_beta)) {
+    lerr("error: -incremental does not combine with -adaptive-rho "
+	 "or -compute-beta");
+    exit(-1);
+  }
+
   printf("+ popinf initialization begin\n");
   fflush(stdout);
 
@@ -73,6 +176,18 @@ SNPSamplingG::SNPSamplingG(Env &env, SNP &snp)
     exit(-1);
   }
 
+  _thf = fopen(Env::file_str("/throughput.txt").c_str(), "w");
+  if (!_thf)  {
+    printf("cannot open throughput file:%s\n",  strerror(errno));
+    exit(-1);
+  }
+
+  _lpf = fopen(Env::file_str("/lambda_passes.txt").c_str(), "w");
+  if (!_lpf)  {
+    printf("cannot open lambda passes file:%s\n",  strerror(errno));
+    exit(-1);
+  }
+
   _tf = fopen(Env::file_str("/test.txt").c_str(), "w");
   if (!_tf)  {
     printf("cannot open heldout file:%s\n",  strerror(errno));
@@ -97,32 +212,53 @@ SNPSamplingG::SNPSamplingG(Env &env, SNP &snp)
     exit(-1);
   }
 
-  if (_env.compute_beta) {
+  if (_env.compute_beta)
     _env.online_iterations = 100; // tightly optimize given the thetas
+  _lambda_passes.resize(_env.online_iterations + 1);
 
+  if (_env.compute_beta) {
     init_heldout_sets();
-    if (_nthreads > 0) {
-      Thread::static_initialize();
-      PhiRunnerG::static_initialize();
-      start_threads();
+    if (load_gamma("gamma.txt") != _n) {
+      lerr("error: gamma.txt does not have %d individuals", _n);
+      exit(-1);
     }
-    lerr("done starting threads");
-    
-    load_gamma();
     estimate_all_theta();
     lerr("done estimating all theta");
+
+    vector<uint32_t> locs;
     if (_env.locations_file == "") {
-      compute_all_lambda();
-      estimate_all_beta();
-      save_beta();
-    } else
-      compute_and_save_beta();
+      for (uint32_t loc = 0; loc < _l; ++loc)
+	locs.push_back(loc);
+    } else {
+      FILE *f = fopen(_env.locations_file.c_str(), "r");
+      assert(f);
+      // a locus is fitted and written by one runner only
+      vector<bool> seen(_l, false);
+      uint32_t loc;
+      while (!feof(f)) {
+	if (fscanf(f, "%d\t%*[^\n]s\n", &loc) >= 0) {
+	  assert (loc < _l);
+	  if (seen[loc]) {
+	    lerr("skipping repeated locus %d in %s", loc,
+		 _env.locations_file.c_str());
+	    continue;
+	  }
+	  seen[loc] = true;
+	  locs.push_back(loc);
+	}
+      }
+      fclose(f);
+      lerr("locs size = %d", locs.size());
+    }
+    compute_beta(locs);
     exit(0);
   }
 
   init_heldout_sets();
   init_gamma();
   init_lambda();
+  if (_env.incremental != "")
+    init_incremental();
 
   _lf = fopen(Env::file_str("/logl.txt").c_str(), "w");
   if (!_lf)  {
@@ -130,11 +266,20 @@ SNPSamplingG::SNPSamplingG(Env &env, SNP &snp)
     exit(-1);
   }
   estimate_all_theta();
-
+  if (_env.topm > 0)
+    init_topm();
+
+  init_heldout_locs();
+  if (_env.conv_loci > 0)
+    init_stream_check();
+  if (start_heldout_threads() < 0) {
+    lerr("cannot start heldout threads");
+    exit(-1);
+  }
   printf("+ computing initial heldout likelihood\n");
-  compute_likelihood(true, true);
-  if (_env.use_test_set)
-    compute_likelihood(true, false);
+  start_heldout(true);
+  wait_heldout();
+  finish_heldout();
   save_gamma();
   printf("\n+ computing initial training likelihood\n");
   printf("+ done..\n");
@@ -145,8 +290,12 @@ SNPSamplingG::SNPSamplingG(Env &env, SNP &snp)
 
   if (_nthreads > 0) {
     Thread::static_initialize();
-    PhiRunnerG::static_initialize();
-    start_threads();
+    // a locus runner is a single thread that takes its locus over all
+    // the individuals itself, so asynchronous mode has no phi workers
+    if (_env.async_groups == 0) {
+      PhiRunnerG::static_initialize();
+      start_threads();
+    }
   }
 }
 
@@ -154,9 +303,26 @@ SNPSamplingG::~SNPSamplingG()
 {
   fclose(_vf);
   fclose(_tf);
+  fclose(_thf);
+  fclose(_lpf);
   fclose(_lf);
+  delete _elbo;
+  delete _adapt_rho;
+  delete _theta_age;
+  delete _theta_drift;
+  delete _act_change;
+  delete[] _frozen;
+  delete _act_etheta;
+  delete _topm_idx;
+  for (uint32_t b = 0; b < _batch_y.size(); ++b)
+    delete _batch_y[b];
+  delete _batch_beta;
+  delete _batch_lambdat;
+  delete _loc_sched;
   fclose(_tef);
   fclose(_vef);
+  if (_scf)
+    fclose(_scf);
 }
 
 void
@@ -295,18 +461,58 @@ SNPSamplingG::init_lambda()
 int
 SNPSamplingG::start_threads()
 {
+  // the workers place their own rows, so the split must exist first
+  split_all_indivs();
+
+  Topology topo;
+  if (_env.pin_threads)
+    Env::plog("numa topology", topo.s());
+
   for (uint32_t i = 0; i < _nthreads; ++i) {
+    int cpu = -1;
+    uint32_t node = 0;
+    if (_env.pin_threads) {
+      cpu = topo.cpu_for(i, _nthreads, node);
+      lerr("thread %d -> node %d, cpu %d", i, node, cpu);
+    }
     PhiRunnerG *t = new PhiRunnerG(_env, &_r, 
-				   _iter, _x, _n, _k, 
+				   _iter, _x, i, cpu, _n, _k, 
 				   0, _t, _snp, *this,
+				   _phimom, _phidad,
 				   _out_q, _in_q, _cm);
     if (t->create() < 0)
       return -1;
     _thread_map[t->id()] = t;
   }
+  
+  // wait until every worker has pinned itself and moved its rows
+  for (uint32_t i = 0; i < _nthreads; ++i) {
+    pthread_t *p = _in_q.pop();
+    assert(p);
+  }
   return 0;
 }
 
+// called by worker thread `chunk` once pinned, while the main thread
+// waits in start_threads(): reallocating the chunk's rows from that
+// thread puts them on its numa node under the default first-touch
+// policy
+void
+SNPSamplingG::first_touch(uint32_t chunk)
+{
+  ChunkMap::const_iterator it = _chunk_map.find(chunk);
+  assert (it != _chunk_map.end());
+  const IndivsList &il = *(it->second);
+  for (uint32_t i = 0; i < il.size(); ++i) {
+    uint32_t n = il[i];
+    _gamma.realloc_row(n);
+    _Etheta.realloc_row(n);
+    _Elogtheta.realloc_row(n);
+    _phimom.realloc_row(n);
+    _phidad.realloc_row(n);
+  }
+}
+
 void
 SNPSamplingG::update_lambda(uint32_t loc)
 {
@@ -357,6 +563,36 @@ SNPSamplingG::split_all_indivs()
       t++;
     }
   }
+  // chunk i is the home range of tiles of worker i; the tiles
+  // themselves get stolen by whoever runs out of work first.  the
+  // tile id picks the slot in the lambda_t reduction tree
+  assert (_chunk_map.size() == _nthreads);
+  uint32_t tsz = tile_size();
+  for (ChunkMap::const_iterator it = _chunk_map.begin(); 
+       it != _chunk_map.end(); ++it) {
+    const IndivsList &il = *(it->second);
+    uint32_t first = _tiles.size();
+    for (uint32_t i = 0; i < il.size(); i += tsz) {
+      uint32_t j = (i + tsz < il.size()) ? i + tsz : il.size();
+      _tiles.push_back(new IndivsList(il.begin() + i, il.begin() + j));
+    }
+    _tile_sched.set_range(it->first, first, _tiles.size());
+  }
+  _lambdat_reduce = new TSReduce(_tiles.size(), _k, _t * nbatch());
+  Env::plog("tile size", tsz);
+  Env::plog("tiles", _tiles.size());
+}
+
+uint32_t
+SNPSamplingG::tile_size() const
+{
+  if (_env.tile_size > 0)
+    return _env.tile_size;
+
+  // keep the rows a tile touches per pass (gamma, Etheta, Elogtheta,
+  // phimom, phidad) within a 32KB L1 data cache
+  uint32_t sz = (32 * 1024) / (5 * _k * sizeof(double));
+  return sz < 8 ? 8 : sz;
 }
 
 void
@@ -365,35 +601,14 @@ SNPSamplingG::optimize_lambda(uint32_t loc)
   _x = 0;
   do {
     debug("x = %d", x);
-    for (ChunkMap::iterator it = _chunk_map.begin(); 
-	 it != _chunk_map.end(); ++it) {
-      IndivsList *il = it->second;
-      debug("pushing chunk of size %d", il->size());
-      _out_q.push(il);
-    }
-
-    _cm.lock();
-    _cm.broadcast();
-    _cm.unlock();
-    
-    _lambdat.zero();
-    uint32_t nt = 0;
-    do {
-      // do not delete p!
-      pthread_t *p = _in_q.pop();
-      assert(p);
-      PhiRunnerG *t = _thread_map[*p];
-      debug("main: threads %d done (id:%ld)", nt+1, t->id());
-      const Matrix &lambdat = t->lambdat();
-      const double **ldt_t = lambdat.const_data();
-      double **ldt = _lambdat.data();
-      for (uint32_t k = 0; k < _k; ++k)
-	for (uint32_t r = 0; r < _t; ++r)
-	  ldt[k][r] += ldt_t[k][r];
-      nt++;
-    } while (nt != _nthreads || !_in_q.empty());
-    
-    assert (nt == _nthreads);
+    // the first pass over a new locus folds the previous training
+    // locus' phis into gamma; decided here rather than by the workers
+    // since a worker may sit out a whole pass while others steal its
+    // tiles
+    _apply_gamma = (_x == 0 && _gamma_pending);
+    _sim_y = (_x == 0 && _sim_pending);
+    run_pass();
+    _lambdat_reduce->result(_lambdat);
 
     _lambdaold.copy_from(loc, _lambda);
     update_lambda(loc);
@@ -402,57 +617,235 @@ SNPSamplingG::optimize_lambda(uint32_t loc)
 
     _x++;
     
-    if (_v.abs_mean() < _env.meanchangethresh)
+    if (lambda_converged(loc, _v))
       break;
   } while (_x < _env.online_iterations);
+  count_passes(_x);
+  _gamma_pending = true;
+  _gamma_loc = loc;
+  _sim_pending = false;
 }
 
+// one pass of the workers over all tiles; returns once the lambda_t
+// reduction is complete
 void
-SNPSamplingG::compute_all_lambda()
+SNPSamplingG::run_pass()
 {
-  split_all_indivs();
-  for (uint32_t loc = 0; loc < _l; ++loc) {
-    _loc = loc;
-    optimize_lambda(loc);
-    _iter++;
-    if (_loc % 100 == 0) {
-      printf("\rloc = %d took %d secs", _iter, duration());
-      fflush(stdout);
+  _tile_sched.begin();
+  for (ChunkMap::iterator it = _chunk_map.begin(); 
+       it != _chunk_map.end(); ++it) {
+    IndivsList *il = it->second;
+    debug("pushing chunk of size %d", il->size());
+    _out_q.push(il);
+  }
+
+  _cm.lock();
+  _cm.broadcast();
+  _cm.unlock();
+    
+  // the workers combine their lambda_t among themselves; only the
+  // thread completing the root of the reduction tree reports back
+  // do not delete p!
+  pthread_t *p = _in_q.pop();
+  assert(p);
+  debug("main: reduction done (id:%ld)", *p);
+}
+
+void
+SNPSamplingG::init_batch()
+{
+  uint32_t nb = nbatch();
+  _batch_locs.resize(nb);
+  _batch_y.resize(nb);
+  for (uint32_t b = 0; b < nb; ++b)
+    _batch_y[b] = new YArray(_n);
+  _batch_sim.resize(nb);
+  _batch_beta = new Matrix(nb, _k);
+  _batch_eb.resize((size_t)_t * nb * _k);
+  _batch_prev_eb.resize((size_t)_t * nb * _k);
+  _batch_et.resize((size_t)_n * _k);
+  _batch_w.resize((size_t)_n * _t * nb);
+  _batch_lambdat = new Matrix(_k, _t * nb);
+}
+
+// B loci drawn as single loci are, uniformly with replacement unless
+// -epoch-block schedules them; as in get_subsample() the workers
+// simulate the genotypes during the first pass
+void
+SNPSamplingG::get_batch()
+{
+  for (uint32_t b = 0; b < nbatch(); ++b) {
+    uint32_t loc = next_loc();
+    _batch_locs[b] = loc;
+    YArrayMap::const_iterator x = _heldout_loc_y.find(loc);
+    if (x == _heldout_loc_y.end()) {
+      _snp.bigsim().beta_row(loc, _batch_beta->data()[b]);
+      _batch_sim[b] = 1;
+    } else {
+      const yval_t * const snpd = x->second->const_data();
+      for (uint32_t i = 0; i < _env.n; i++)
+	(*_batch_y[b])[i] = snpd[i];
+      _batch_sim[b] = 0;
     }
   }
+  _loc = _batch_locs[0];
+  _sim_pending = true;
+}
+
+void
+SNPSamplingG::sim_batch_tile(const IndivsList &tile)
+{
+  assert (tile.size() > 0);
+  uint32_t first = tile[0], last = tile[tile.size() - 1] + 1;
+  assert (last - first == tile.size());
+  for (uint32_t b = 0; b < nbatch(); ++b)
+    if (_batch_sim[b])
+      _snp.bigsim().sim_set_y(_batch_beta->const_data()[b], _batch_locs[b],
+			      first, last, *_batch_y[b]);
 }
 
+// optimize_lambda() over a batch of loci: every pass refines all of
+// their lambdas at once, and the batch is done when each has settled.
+// the workers' lambda_t comes back as theta' W, which is scaled here
+// by exp(Elogbeta) into sum_n y phi
+void
+SNPSamplingG::optimize_batch()
+{
+  uint32_t nb = nbatch();
+  _x = 0;
+  bool done;
+  do {
+    _apply_gamma = (_x == 0 && _gamma_pending);
+    _sim_y = (_x == 0 && _sim_pending);
+    _batch_first = (_x == 0);
+    for (uint32_t b = 0; b < nb; ++b) {
+      const double ** const elogbetad = _Elogbeta.const_data()[_batch_locs[b]];
+      for (uint32_t t = 0; t < _t; ++t)
+	for (uint32_t k = 0; k < _k; ++k)
+	  _batch_eb[(b * _t + t) * _k + k] = exp(elogbetad[k][t]);
+    }
+    run_pass();
+    _lambdat_reduce->result(*_batch_lambdat);
+
+    const double ** const bld = _batch_lambdat->const_data();
+    double **ldt = _lambdat.data();
+    done = true;
+    for (uint32_t b = 0; b < nb; ++b) {
+      uint32_t loc = _batch_locs[b];
+      for (uint32_t k = 0; k < _k; ++k)
+	for (uint32_t t = 0; t < _t; ++t)
+	  ldt[k][t] = bld[k][b * _t + t] * _batch_eb[(b * _t + t) * _k + k];
+      _lambdaold.copy_from(loc, _lambda);
+      update_lambda(loc);
+      estimate_beta(loc);
+      sub(loc, _lambda, _lambdaold, _v);
+      if (!lambda_converged(loc, _v))
+	done = false;
+    }
+    _x++;
+  } while (!done && _x < _env.online_iterations);
+  count_passes(_x);
+  // the gamma step uses the weights and exp(Elogbeta) of this last pass
+  _batch_prev_eb.swap(_batch_eb);
+  _gamma_pending = true;
+  _sim_pending = false;
+}
 
+// fit the loci in locs against the fixed theta, on the worker
+// threads if any, and stream their beta rows to the beta file in
+// list order as they complete
 void
-SNPSamplingG::compute_and_save_beta()
+SNPSamplingG::compute_beta(const vector<uint32_t> &locs)
 {
-  lerr("within compute_and_save_beta()");
-  FILE *f = fopen(_env.locations_file.c_str(), "r");
-  assert(f);
-  uint32_t loc;
-  char b[4096*4];
-  vector<uint32_t> locs;
-  while (!feof(f)) {
-    if (fscanf(f, "%d\t%*[^\n]s\n", &loc, b) >= 0) {
-      lerr("loc = %d", loc);
-      locs.push_back(loc);
+  FILE *f = fopen(add_iter_suffix("/beta").c_str(), "w");
+  if (!f)  {
+    lerr("cannot open beta or lambda file:%s\n",  strerror(errno));
+    exit(-1);
+  }
+
+  _beta_locs = locs;
+  _beta_ready.resize(locs.size(), 0);
+  _beta_next = 0;
+
+  BetaRunnerG *self = NULL;
+  vector<BetaRunnerG *> runners;
+  if (_nthreads > 0) {
+    Thread::static_initialize();
+    for (uint32_t i = 0; i < _nthreads; ++i) {
+      BetaRunnerG *t = new BetaRunnerG(_env, _n, _k, _t, *this);
+      if (t->create() < 0) {
+	lerr("cannot create beta runner");
+	exit(-1);
+      }
+      runners.push_back(t);
+    }
+  } else
+    self = new BetaRunnerG(_env, _n, _k, _t, *this);
+
+  const double **ebeta = _Ebeta.const_data();
+  uint32_t w = 0;
+  while (w < locs.size()) {
+    uint32_t i = 0;
+    if (self) {
+      if (beta_claim(i))
+	self->fit(i);
+    } else {
+      _beta_cm.lock();
+      while (!_beta_ready[w])
+	_beta_cm.wait();
+      _beta_cm.unlock();
+    }
+
+    for (; w < locs.size(); ++w) {
+      _beta_cm.lock();
+      bool ready = _beta_ready[w];
+      _beta_cm.unlock();
+      if (!ready)
+	break;
+      uint32_t loc = locs[w];
+      fprintf(f, "%d\t", loc);
+      for (uint32_t k = 0; k < _k; ++k)
+	fprintf(f, "%.8f\t", ebeta[loc][k]);
+      fprintf(f, "\n");
+      if (w % 1000 == 0) {
+	fflush(f);
+	printf("\rloc = %d took %d secs", w, duration());
+	fflush(stdout);
+      }
     }
   }
   fclose(f);
-  lerr("locs size = %d", locs.size());
-  
-  split_all_indivs();
-  for (uint32_t i = 0; i < locs.size(); ++i) {
-    uint32_t loc = locs[i];
-    _loc = loc;
-    optimize_lambda(loc);
-    _iter++;
-    if (_loc % 100 == 0) {
-      printf("\rloc = %d took %d secs", _iter, duration());
-      fflush(stdout);
-    }
+  printf("\n");
+  lerr("computed beta at %d loci in %d secs", locs.size(), duration());
+
+  for (uint32_t i = 0; i < runners.size(); ++i) {
+    runners[i]->join();
+    delete runners[i];
   }
-  save_beta(locs);
+  delete self;
+}
+
+bool
+SNPSamplingG::beta_claim(uint32_t &i)
+{
+  i = __sync_fetch_and_add(&_beta_next, 1);
+  return i < _beta_locs.size();
+}
+
+// each locus' rows of lambda and beta are written by its runner
+// alone; the lock publishes them to the writer
+void
+SNPSamplingG::beta_done(uint32_t i, const Array &beta)
+{
+  uint32_t loc = _beta_locs[i];
+  double **ebeta = _Ebeta.data();
+  for (uint32_t k = 0; k < _k; ++k)
+    ebeta[loc][k] = beta[k];
+
+  _beta_cm.lock();
+  _beta_ready[i] = 1;
+  _beta_cm.signal();
+  _beta_cm.unlock();
 }
 
 void
@@ -472,51 +865,113 @@ SNPSamplingG::get_subsample(uint32_t loc)
 
   YArrayMap::const_iterator x = _heldout_loc_y.find(loc);
   if (x == _heldout_loc_y.end()) {
-    _snp.sim3_set_y(loc, *_y);
-    debug("loc:%d, %s", loc, _y->s().c_str());
+    // the workers simulate the genotypes tile by tile at the start
+    // of the first pass over this locus; see sim_tile()
+    _snp.bigsim().beta_row(loc, _sim_beta.data());
+    _sim_pending = true;
   } else {
-    YArray *y = x->second;
-    const yval_t * const snpd = y->const_data();
+    const yval_t * const snpd = x->second->const_data();
     for (uint32_t i = 0; i < _env.n; i++)
       (*_y)[i] = snpd[i];
     debug("HELDOUT loc:%d, %s", loc, _y->s().c_str());
   }
 }
 
+// tiles are contiguous runs of individuals
+void
+SNPSamplingG::sim_tile(const IndivsList &tile)
+{
+  assert (tile.size() > 0);
+  uint32_t first = tile[0], last = tile[tile.size() - 1] + 1;
+  assert (last - first == tile.size());
+  _snp.bigsim().sim_set_y(_sim_beta.const_data(), _loc, first, last, *_y);
+}
+
+void
+SNPSamplingG::fill_y(uint32_t loc, YArray &y)
+{
+  YArrayMap::const_iterator x = _heldout_loc_y.find(loc);
+  if (x == _heldout_loc_y.end()) {
+    _snp.bigsim().sim_set_y(loc, y);
+    debug("loc:%d, %s", loc, y.s().c_str());
+  } else {
+    const yval_t * const snpd = x->second->const_data();
+    for (uint32_t i = 0; i < _env.n; i++)
+      y[i] = snpd[i];
+    debug("HELDOUT loc:%d, %s", loc, y.s().c_str());
+  }
+}
+
 void
 SNPSamplingG::infer()
 {
-  split_all_indivs();
-  
-  while (1) {
-    _loc = gsl_rng_uniform_int(_r, _l);
-    get_subsample(_loc);
+  if (_env.async_groups > 0) {
+    infer_async();
+    return;
+  }
 
-    debug("optimizing lambda for loc:%d, y:%s", _loc, _y->s().c_str());
-    debug("LOC = %d", _loc);
-    optimize_lambda(_loc);
+  while (1) {
+    if (nbatch() > 1) {
+      get_batch();
+      optimize_batch();
+    } else {
+      _loc = next_loc();
+      get_subsample(_loc);
+
+      debug("optimizing lambda for loc:%d", _loc);
+      debug("LOC = %d", _loc);
+      optimize_lambda(_loc);
+    }
     
     // threads update gamma in the next iteration
     // prior to updating phis
     _iter++;
+    _nloci += nbatch();
+    if (_incr_hold && _nloci >= _incr_until)
+      incr_release();
 
     if (_iter % 100 == 0) {
       printf("\riteration = %d took %d secs", _iter, duration());
       fflush(stdout);
     }
 
+    if (_env.conv_loci > 0)
+      stream_check(_env.conv_loci);
+
     if (_iter % _env.reportfreq == 0) {
       printf("iteration = %d took %d secs\n", 
 	     _iter, duration());
       lerr("iteration = %d took %d secs\n", _iter, duration());
+      if (_env.compute_logl)
+	logl();
+      save_lambda_passes();
+      if (_loc_sched)
+	lerr("locus epoch %d", _loc_sched->epoch());
+      if (_env.lazy_theta > 0)
+	lerr("exact theta refreshes: %lu of %lu", _theta_exact, _theta_all);
+      if (_env.active_set > 0)
+	lerr("frozen individuals: %d of %d", nfrozen(), _n);
+      // with -conv-loci the full pass waits for the streaming check
+      if (_env.conv_loci == 0)
+	_hol_wanted = true;
+      else {
+	lerr("saving theta @ %d secs", duration());
+	save_model();
+      }
+    }
+
+    // the heldout likelihood is computed in the background; a report
+    // falling due while the previous one still runs is posted after it
+    if (_hol_wanted && !_hol_busy) {
       lerr("computing heldout likelihood @ %d secs", duration());
-      compute_likelihood(false, true);
-      if (_env.use_test_set)
-	compute_likelihood(false, false);
+      start_heldout(false);
+      _hol_wanted = false;
       lerr("saving theta @ %d secs", duration());
       save_model();
       lerr("done @ %d secs", duration());
     }
+    if (_hol_busy && _hol_ready)
+      finish_heldout();
 
     if (_env.terminate) {
       save_model();
@@ -525,58 +980,178 @@ SNPSamplingG::infer()
   }
 }
 
-double
-SNPSamplingG::compute_likelihood(bool first, bool validation)
+// heldout loci are grouped once; each evaluation scores the same
+// list, validation loci first
+void
+SNPSamplingG::init_heldout_locs()
 {
-  _hol_mode = true;
-  uint32_t k = 0;
-  double s = .0;
+  SNPMap *maps[2] = { &_validation_map, &_test_map };
+  for (uint32_t v = 0; v < 2; ++v) {
+    if (v == 1 && !_env.use_test_set)
+      break;
+    SNPByLoc m;
+    for (SNPMap::const_iterator i = maps[v]->begin(); i != maps[v]->end(); ++i) {
+      const KV &kv = i->first;
+      m[kv.second].push_back(kv.first);
+    }
+    for (SNPByLoc::const_iterator i = m.begin(); i != m.end(); ++i) {
+      HeldoutLocG h;
+      h.loc = i->first;
+      h.validation = (v == 0);
+      h.indivs = i->second;
+      _hol_locs.push_back(h);
+    }
+  }
+  _hol_lambda = new D3(_hol_locs.size(), _k, _t);
+  _hol_lsum.resize(_hol_locs.size());
+  Env::plog("heldout loci", _hol_locs.size());
+}
 
-  SNPMap *mp = NULL;
-  FILE *ff = NULL;
-  if (validation) {
-    mp = &_validation_map;
-    ff = _vf;
-  } else {
-    mp = &_test_map;
-    ff = _tf;
+int
+SNPSamplingG::start_heldout_threads()
+{
+  // the evaluation runs alongside inference, so it gets a quarter of
+  // the workers' share of cores; under -pin each runner shares the
+  // cpu of a worker spread evenly over the pool (and the nodes)
+  uint32_t nthreads = _nthreads / 4 > 0 ? _nthreads / 4 : 1;
+  Env::plog("heldout runners", nthreads);
+  Topology topo;
+  for (uint32_t i = 0; i < nthreads; ++i) {
+    int cpu = -1;
+    uint32_t node = 0;
+    if (_env.pin_threads && _nthreads > 0)
+      cpu = topo.cpu_for(i * _nthreads / nthreads, _nthreads, node);
+    HeldoutRunnerG *r = new HeldoutRunnerG(_env, _n, _k, _t, *this, cpu);
+    if (r->create() < 0)
+      return -1;
+    _hol_runners.push_back(r);
   }
+  return 0;
+}
+
+// post an evaluation of the current model; the caller must keep the
+// model quiet until this returns
+void
+SNPSamplingG::start_heldout(bool first)
+{
+  assert (!_hol_busy);
+  topm_flush();
+  _hol_Etheta.copy_from(_Etheta);
+  _hol_Elogtheta.copy_from(_Elogtheta);
+  double ***hld = _hol_lambda->data();
+  const double ***ld = _lambda.const_data();
+  for (uint32_t i = 0; i < _hol_locs.size(); ++i)
+    for (uint32_t k = 0; k < _k; ++k)
+      for (uint32_t t = 0; t < _t; ++t)
+	hld[i][k][t] = ld[_hol_locs[i].loc][k][t];
+
+  _hol_first = first;
+  _hol_iter = _iter;
+  _hol_secs = duration();
+  _hol_nloci = _nloci;
+  _hol_busy = true;
+  _hol_ready = (_hol_locs.size() == 0);
+
+  // the snapshot is complete before any locus can be claimed
+  _hol_left = _hol_locs.size();
+  __sync_synchronize();
+  _hol_next = 0;
+
+  _hol_cm.lock();
+  _hol_gen++;
+  _hol_cm.broadcast();
+  _hol_cm.unlock();
+}
+
+void
+SNPSamplingG::wait_heldout()
+{
+  _hol_cm.lock();
+  while (!_hol_ready)
+    _hol_cm.wait();
+  _hol_cm.unlock();
+}
 
-  SNPByLoc m;
-  for (SNPMap::const_iterator i = mp->begin(); i != mp->end(); ++i) {
-    const KV &kv = i->first;
+void
+SNPSamplingG::heldout_wait(uint32_t &gen)
+{
+  _hol_cm.lock();
+  while (_hol_gen == gen)
+    _hol_cm.wait();
+  gen = _hol_gen;
+  _hol_cm.unlock();
+}
 
-    uint32_t indiv = kv.first;
-    uint32_t loc = kv.second;
+bool
+SNPSamplingG::heldout_claim(uint32_t &i)
+{
+  i = __sync_fetch_and_add(&_hol_next, 1);
+  return i < _hol_locs.size();
+}
 
-    vector<uint32_t> &v = m[loc];
-    v.push_back(indiv);
+void
+SNPSamplingG::heldout_done(uint32_t i, double lsum)
+{
+  _hol_lsum[i] = lsum;
+  if (__sync_sub_and_fetch(&_hol_left, 1) == 0) {
+    _hol_cm.lock();
+    _hol_ready = true;
+    _hol_cm.broadcast();
+    _hol_cm.unlock();
   }
+}
 
-  vector<uint32_t> indivs;
-  uint32_t sz = 0;
-  for (SNPByLoc::const_iterator i = m.begin(); i != m.end(); ++i) {
-    uint32_t loc = i->first;
-    indivs = i->second;
-    printf("\rdone:%.2f%%", ((double)sz / m.size())*100);
-    double u = snp_likelihood(loc, indivs, first);
-    s += u;
-    k += indivs.size();
-    sz++;
+// per-locus sums are added in list order, so the result does not
+// depend on which runner scored which locus
+void
+SNPSamplingG::finish_heldout()
+{
+  assert (_hol_busy && _hol_ready);
+  __sync_synchronize();
+  double s[2] = { .0, .0 };
+  uint32_t k[2] = { 0, 0 };
+  for (uint32_t i = 0; i < _hol_locs.size(); ++i) {
+    uint32_t v = _hol_locs[i].validation ? 0 : 1;
+    s[v] += _hol_lsum[i];
+    k[v] += _hol_locs[i].indivs.size();
   }
-  fprintf(ff, "%d\t%d\t%.9f\t%d\t%f\n", _iter, duration(), (s / k), k, exp(s/k));
+  _hol_busy = false;
+  report_likelihood(true, s[0], k[0]);
+  if (_env.use_test_set)
+    report_likelihood(false, s[1], k[1]);
+}
+
+void
+SNPSamplingG::report_likelihood(bool validation, double s, uint32_t k)
+{
+  FILE *ff = validation ? _vf : _tf;
+  fprintf(ff, "%d\t%d\t%.9f\t%d\t%f\n", _hol_iter, _hol_secs, (s / k), k, exp(s/k));
   fflush(ff);
   
   double a = (s / k);
 
-  if (!validation) {
-    _hol_mode = false;
-    return 0;
+  // iteration, secs, training loci, loci/sec since the last report,
+  // heldout likelihood; comparable between -async-groups runs and
+  // the synchronous mode
+  if (validation) {
+    uint32_t secs = _hol_secs;
+    double rate = .0;
+    if (secs > _last_report_secs)
+      rate = (double)(_hol_nloci - _last_report_loci) / (secs - _last_report_secs);
+    fprintf(_thf, "%d\t%d\t%lu\t%.2f\t%.9f\n", 
+	    _hol_iter, secs, _hol_nloci, rate, a);
+    fflush(_thf);
+    _last_report_loci = _hol_nloci;
+    _last_report_secs = secs;
   }
+
+  if (!validation)
+    return;
   
   bool stop = false;
   int why = -1;
-  if (_iter > 2000) {
+  // with -incremental, not before the previous individuals are let go
+  if (_hol_iter > 2000 && _hol_nloci >= _incr_until) {
     if (a > _prev_h && 
 	_prev_h != 0 && fabs((a - _prev_h) / _prev_h) < _env.stop_threshold) {
       stop = true;
@@ -602,19 +1177,121 @@ SNPSamplingG::compute_likelihood(bool first, bool validation)
 
     FILE *f = fopen(Env::file_str("/max.txt").c_str(), "w");
     fprintf(f, "%d\t%d\t%.5f\t%.5f\t%.5f\t%.5f\t%d\n",
-	    _iter, duration(),
+	    _hol_iter, _hol_secs,
 	    a, t, v, _max_h,
 	    why);
     fclose(f);
 
     if (_env.use_validation_stop) {
-      _hol_mode = false;
+      if (_async_runners.size() > 0)
+	async_pause();
       save_model();
       exit(0);
     }
   }
-  _hol_mode = false;
-  return (s / k) / _n;
+}
+
+void
+SNPSamplingG::init_stream_check()
+{
+  for (uint32_t i = 0; i < _hol_locs.size(); ++i)
+    if (_hol_locs[i].validation) {
+      _sc_locs.push_back(i);
+      estimate_beta(_hol_locs[i].loc);
+    }
+  _sc_last.resize(_sc_locs.size());
+  _sc_last_iter.resize(_sc_locs.size());
+  _sc_seen.resize(_sc_locs.size(), false);
+
+  _scf = fopen(Env::file_str("/conv.txt").c_str(), "w");
+  if (!_scf)  {
+    lerr("cannot open conv file:%s\n",  strerror(errno));
+    exit(-1);
+  }
+  Env::plog("streaming check loci per iteration", _env.conv_loci);
+}
+
+// score nloci validation loci, drawn at random, against the current
+// theta and beta; only the locus' held-out pairs are touched, so a
+// locus costs O(pairs K).  a score taken again gives the change since
+// the locus was last scored, over the iterations in between
+void
+SNPSamplingG::stream_check(uint32_t nloci)
+{
+  if (_sc_locs.size() == 0)
+    return;
+  const double ** const etheta = _Etheta.const_data();
+  const double ** const ebeta = _Ebeta.const_data();
+  for (uint32_t b = 0; b < nloci; ++b) {
+    Philox g((uint64_t)_env.seed, CHECK_STREAM, _sc_draws, 0);
+    uint32_t i = g.uniform_int(_sc_locs.size());
+    const HeldoutLocG &h = _hol_locs[_sc_locs[i]];
+    YArrayMap::const_iterator x = _heldout_loc_y.find(h.loc);
+    assert (x != _heldout_loc_y.end());
+    double s = _sc_holike.score(etheta, ebeta[h.loc], h.indivs,
+				x->second->const_data());
+    s /= h.indivs.size();
+    if (!_sc_seen[i]) {
+      _sc_seen[i] = true;
+      _sc_nseen++;
+      _sc_total += s;
+    } else {
+      _sc_total += s - _sc_last[i];
+      if (_iter > _sc_last_iter[i]) {
+	_sc_d.push_back(s - _sc_last[i]);
+	_sc_gap.push_back(_iter - _sc_last_iter[i]);
+      }
+    }
+    _sc_last[i] = s;
+    _sc_last_iter[i] = _iter;
+    if (++_sc_draws % _sc_locs.size() == 0)
+      stream_sweep();
+  }
+}
+
+// every _sc_locs.size() draws: the estimate is the mean of the latest
+// locus scores, the trend the change per iteration over the sweep's
+// rescored loci (a ratio estimate, so short gaps weigh little).  a
+// full heldout pass is posted once the 95% interval on the
+// trend, projected over rfreq iterations, lies within the stopping
+// threshold on both sides; a falling score is never convergence.
+// that pass then applies the usual stopping rule
+void
+SNPSamplingG::stream_sweep()
+{
+  uint32_t iters = _iter - _sc_sweep_iter;
+  _sc_sweep_iter = _iter;
+  uint32_t m = _sc_d.size();
+  if (m >= 2 && iters > 0) {
+    double est = _sc_total / _sc_nseen;
+    double dsum = .0, gsum = .0;
+    for (uint32_t j = 0; j < m; ++j) {
+      dsum += _sc_d[j];
+      gsum += _sc_gap[j];
+    }
+    double mean = dsum / gsum;
+    double var = .0;
+    for (uint32_t j = 0; j < m; ++j) {
+      double r = _sc_d[j] - mean * _sc_gap[j];
+      var += r * r;
+    }
+    double gbar = gsum / m;
+    var /= (m - 1) * m * gbar * gbar;
+    double w = 1.96 * sqrt(var);
+    double scale = (double)_env.reportfreq / fabs(est);
+    double ub = (mean + w) * scale;
+    double lb = (mean - w) * scale;
+    bool conv = _iter > 2000 && ub < _env.stop_threshold
+      && lb > -_env.stop_threshold;
+
+    fprintf(_scf, "%d\t%d\t%.9f\t%.3e\t%.3e\t%.3e\t%d\n", 
+	    _iter, duration(), est, mean, lb, ub, conv);
+    fflush(_scf);
+    if (conv)
+      _hol_wanted = true;
+  }
+  _sc_d.clear();
+  _sc_gap.clear();
 }
 
 void
@@ -662,45 +1339,212 @@ SNPSamplingG::add_iter_suffix(const char *c)
   return Env::file_str(sa.str());
 }
 
-void
-SNPSamplingG::save_model()
+// variational bound over the training pairs, or an unbiased
+// estimate from -elbo-loci sampled loci
+double
+SNPSamplingG::logl()
 {
-  save_gamma();
+  if (!_elbo)
+    _elbo = new ELBO<SNPSamplingG>(_env, *this, _nthreads);
+  topm_flush();
+  double p1, p2, p3;
+  double s = _elbo->compute(_env.elbo_loci, p1, p2, p3);
+
+  info("approx. log likelihood = %f\n", s);
+  fprintf(_lf, "%d\t%d\t%.5f\t%.5f\t%.5f\t%.5f\n", 
+	  _iter, duration(), s, p1, p2, p3);
+  fflush(_lf);
+  return s;
+}
+
+uint32_t
+SNPSamplingG::nfrozen() const
+{
+  uint32_t c = 0;
+  for (uint32_t n = 0; n < _n; ++n)
+    if (_frozen[n])
+      c++;
+  return c;
 }
 
 void
-SNPSamplingG::estimate_all_theta()
+SNPSamplingG::init_topm()
 {
-  const double ** const gd = _gamma.const_data();
-  double **theta = _Etheta.data();
-  for (uint32_t n = 0; n < _n; ++n) {
-    double s = .0;
-    for (uint32_t k = 0; k < _k; ++k)
-      s += gd[n][k];
-    assert(s);
-    for (uint32_t k = 0; k < _k; ++k)
-      theta[n][k] = gd[n][k] / s;
-  }
-  PopLib::set_dir_exp(_gamma, _Elogtheta);
+  _topm_idx = new D2Array<uint32_t>(_n, _env.topm);
+  _topm_state.resize(_n);
+  for (uint32_t n = 0; n < _n; ++n)
+    topm_refresh(n);
 }
 
+// orders populations by decreasing gamma
+struct GammaGreater {
+  GammaGreater(const double *g) : _g(g) { }
+  bool operator()(uint32_t a, uint32_t b) const { return _g[a] > _g[b]; }
+  const double *_g;
+};
+
+// catches up individual n's off-support gamma, recomputes all of its
+// theta and chooses its support afresh
 void
-SNPSamplingG::estimate_all_beta()
+SNPSamplingG::topm_refresh(uint32_t n)
 {
-  const double ***ld = _lambda.const_data();
-  double **betad = _Ebeta.data();
+  uint32_t m = _env.topm;
+  uint32_t *idx = _topm_idx->data()[n];
+  double *gd = _gamma.data()[n];
+  double *theta = _Etheta.data()[n];
+  double *elogtheta = _Elogtheta.data()[n];
+  TopMState &st = _topm_state[n];
+
+  if (st.age > 0) {
+    vector<double> keep(m);
+    for (uint32_t j = 0; j < m; ++j)
+      keep[j] = gd[idx[j]];
+    for (uint32_t k = 0; k < _k; ++k)
+      gd[k] = _alpha[k] + (gd[k] - _alpha[k]) * st.scale;
+    for (uint32_t j = 0; j < m; ++j)
+      gd[idx[j]] = keep[j];
+  }
 
-  for (uint32_t loc = 0; loc < _l; ++loc) {
-    for (uint32_t k = 0; k < _k; ++k) {
-      double s = .0;
-      for (uint32_t t = 0; t < _t; ++t)
-	s += ld[loc][k][t];
-      betad[loc][k] = ld[loc][k][0] / s;
+  double s = .0;
+  for (uint32_t k = 0; k < _k; ++k)
+    s += gd[k];
+  assert(s);
+  double psi_sum = gsl_sf_psi(s);
+  for (uint32_t k = 0; k < _k; ++k) {
+    theta[k] = gd[k] / s;
+    elogtheta[k] = gsl_sf_psi(gd[k]) - psi_sum;
+  }
+
+  vector<uint32_t> order(_k);
+  for (uint32_t k = 0; k < _k; ++k)
+    order[k] = k;
+  nth_element(order.begin(), order.begin() + m, order.end(),
+	      GammaGreater(gd));
+
+  double a = .0, b = .0;
+  for (uint32_t j = 0; j < _k; ++j) {
+    uint32_t k = order[j];
+    if (j < m)
+      idx[j] = k;
+    else {
+      a += _alpha[k];
+      b += gd[k] - _alpha[k];
     }
   }
+  st.scale = 1.0;
+  st.aoff = a;
+  st.boff = b;
+  st.age = 0;
 }
 
-inline void
+// off the support phi is zero, so the step there is
+//   g_k <- g_k + rho (alpha_k - g_k)
+// which only scales g_k - alpha_k by 1 - rho; those components wait
+// for the next refresh, every topm_refresh updates.  until then their
+// Etheta and Elogtheta are stale, but only the support's are read
+void
+SNPSamplingG::topm_update(uint32_t n, yval_t y, const double *phimom,
+			  const double *phidad, double rho)
+{
+  uint32_t m = _env.topm;
+  const uint32_t * const idx = _topm_idx->const_data()[n];
+  double *gd = _gamma.data()[n];
+  double *theta = _Etheta.data()[n];
+  double *elogtheta = _Elogtheta.data()[n];
+  TopMState &st = _topm_state[n];
+
+  double s = .0;
+  for (uint32_t j = 0; j < m; ++j) {
+    uint32_t k = idx[j];
+    gd[k] += rho * (_alpha[k] + _env.l * (y * phimom[j] + (2 - y) * phidad[j])
+		    - gd[k]);
+    s += gd[k];
+  }
+  st.scale *= 1 - rho;
+  s += st.aoff + st.boff * st.scale;
+
+  double psi_sum = gsl_sf_psi(s);
+  for (uint32_t j = 0; j < m; ++j) {
+    uint32_t k = idx[j];
+    theta[k] = gd[k] / s;
+    elogtheta[k] = gsl_sf_psi(gd[k]) - psi_sum;
+  }
+  if (++st.age >= _env.topm_refresh)
+    topm_refresh(n);
+}
+
+// brings every individual's theta up to date before it is read as a
+// whole (heldout snapshot, bound, saved model); the workers are idle
+void
+SNPSamplingG::topm_flush()
+{
+  if (!_topm_idx)
+    return;
+  for (uint32_t n = 0; n < _n; ++n)
+    if (_topm_state[n].age > 0)
+      topm_refresh(n);
+}
+
+// passes per locus visit so far: iteration, secs, visits, mean
+// passes, then the number of visits that took 1, 2, ... passes
+void
+SNPSamplingG::save_lambda_passes()
+{
+  uint64_t visits = 0, passes = 0;
+  for (uint32_t x = 1; x < _lambda_passes.size(); ++x) {
+    visits += _lambda_passes[x];
+    passes += x * _lambda_passes[x];
+  }
+  fprintf(_lpf, "%d\t%d\t%lu\t%.3f", _iter, duration(), visits,
+	  visits > 0 ? (double)passes / visits : .0);
+  for (uint32_t x = 1; x < _lambda_passes.size(); ++x)
+    fprintf(_lpf, "\t%lu", _lambda_passes[x]);
+  fprintf(_lpf, "\n");
+  fflush(_lpf);
+}
+
+void
+SNPSamplingG::save_model()
+{
+  topm_flush();
+  save_gamma();
+  if (_env.save_beta)
+    save_lambda();
+}
+
+void
+SNPSamplingG::estimate_all_theta()
+{
+  const double ** const gd = _gamma.const_data();
+  double **theta = _Etheta.data();
+  for (uint32_t n = 0; n < _n; ++n) {
+    double s = .0;
+    for (uint32_t k = 0; k < _k; ++k)
+      s += gd[n][k];
+    assert(s);
+    for (uint32_t k = 0; k < _k; ++k)
+      theta[n][k] = gd[n][k] / s;
+  }
+  PopLib::set_dir_exp(_gamma, _Elogtheta);
+}
+
+void
+SNPSamplingG::estimate_all_beta()
+{
+  const double ***ld = _lambda.const_data();
+  double **betad = _Ebeta.data();
+
+  for (uint32_t loc = 0; loc < _l; ++loc) {
+    for (uint32_t k = 0; k < _k; ++k) {
+      double s = .0;
+      for (uint32_t t = 0; t < _t; ++t)
+	s += ld[loc][k][t];
+      betad[loc][k] = ld[loc][k][0] / s;
+    }
+  }
+}
+
+inline void
 SNPSamplingG::update_phimom(uint32_t n, uint32_t loc)
 {
   const double ** const elogthetad = _Elogtheta.const_data();
@@ -727,30 +1571,55 @@ PhiRunnerG::do_work()
 {
   bool first = true;
   _idptr = new pthread_t(pthread_self());
-  _oldilist = NULL;
+
+  if (_cpu >= 0) {
+    if (pin(_cpu) < 0)
+      lerr("thread %d: cannot pin to cpu %d", _idx, _cpu);
+    else
+      _pop.first_touch(_idx);
+  }
+  _in_q.push(_idptr);
   
   do {
-    IndivsList *ilist = _out_q.pop();
-    debug("thread = %ld, popped size %d, at0: %d\n", 
-	 id(), ilist->size(), (*ilist)[0]);
-    if (first || _prev_iter != _iter) {
-      debug("thread = %ld, NEW loc = %d\n", id(), _pop.sampled_loc());
-      
-      if (!first) {
-	if (!_prev_hol_mode) {
-	  update_gamma();
-	  estimate_theta();
+    // the popped chunk only wakes this worker; tiles come from the
+    // scheduler
+    _out_q.pop();
+    TileScheduler &ts = _pop.tile_sched();
+    uint32_t gen = ts.gen();
+    bool apply_gamma = false, started = false;
+
+    uint32_t t = 0;
+    while (ts.next(_idx, gen, t)) {
+      // holding a tile keeps the pass open, so only now is the main
+      // thread's per-pass state (iter, locus, gamma flag) safe to read;
+      // a worker late from the previous pass gets no tiles and never
+      // gets here
+      if (!started) {
+	if (first || _prev_iter != _iter) {
+	  debug("thread = %ld, NEW loc = %d\n", id(), _pop.sampled_loc());
+	  reset(_pop.sampled_loc());
+	  first = false;
 	}
+	apply_gamma = _pop.apply_gamma();
+	started = true;
+      }
+      const IndivsList &tile = _pop.tile(t);
+      // apply the previous locus' phis to the tile we are about to
+      // process, so that no other thread reads these rows meanwhile
+      if (_pop.nbatch() > 1)
+	process_batch(tile, apply_gamma);
+      else {
+	if (apply_gamma)
+	  update_gamma(tile);
+	if (_pop.sim_y())
+	  _pop.sim_tile(tile);
+	_lambdat.zero();
+	process(tile);
       }
-      reset(_pop.sampled_loc());
-      first = false;
-    }
-
-    _oldilist = ilist;
-    _lambdat.zero();
-    process(*ilist);
 
-    _in_q.push(_idptr);
+      if (_pop.lambdat_reduce().contribute(t, _lambdat))
+	_in_q.push(_idptr);
+    }
     
     _cm.lock();
     while (_x == _prev_x && _iter == _prev_iter)
@@ -764,57 +1633,348 @@ PhiRunnerG::do_work()
 void
 SNPSamplingG::update_rho_indiv(uint32_t n)
 {
-  _rho_indiv[n] = pow(_nodetau0 + _c_indiv[n], -1 * _nodekappa);
+  _rho_indiv[n] = _rho_indiv_table(_c_indiv[n]);
   _c_indiv[n]++;
 }
 
+// thread-safe variant of update_rho_indiv() for the async runners
+double
+SNPSamplingG::next_rho_indiv(uint32_t n)
+{
+  uint32_t c = __sync_fetch_and_add(_c_indiv.data() + n, 1);
+  return _rho_indiv_table(c);
+}
+
 void
-PhiRunnerG::update_gamma(const IndivsList &indivs)
+SNPSamplingG::infer_async()
+{
+  uint32_t ngroups = _env.async_groups;
+  _loc_busy = new uint8_t[_l];
+  memset((void *)_loc_busy, 0, _l);
+
+  Env::plog("async locus runners", ngroups);
+  lerr("async: %d locus runners of one thread each, no phi workers",
+       ngroups);
+  for (uint32_t i = 0; i < ngroups; ++i) {
+    LocusRunnerG *r = new LocusRunnerG(_env, i, _n, _k, _t, *this);
+    if (r->create() < 0) {
+      lerr("cannot create locus runner %d", i);
+      exit(-1);
+    }
+    _async_runners.push_back(r);
+  }
+
+  uint32_t next_report = _env.reportfreq;
+  uint32_t next_print = 100;
+  while (1) {
+    usleep(10000);
+
+    uint32_t iter = _iter;
+    if (_incr_hold && _nloci >= _incr_until)
+      incr_release();
+    if (iter >= next_print) {
+      printf("\riteration = %d took %d secs", iter, duration());
+      fflush(stdout);
+      next_print = (iter / 100 + 1) * 100;
+    }
+
+    if (_env.terminate) {
+      async_pause();
+      save_model();
+      exit(0);
+    }
+
+    if (_hol_busy && _hol_ready)
+      finish_heldout();
+
+    // scores read the model while the runners write it; the check
+    // only needs a trend
+    if (_env.conv_loci > 0 && iter > _sc_iter) {
+      uint64_t m = (uint64_t)(iter - _sc_iter) * _env.conv_loci;
+      stream_check(m < _sc_locs.size() ? m : _sc_locs.size());
+      _sc_iter = iter;
+    }
+
+    if (iter >= next_report) {
+      printf("iteration = %d took %d secs\n", iter, duration());
+      lerr("iteration = %d took %d secs\n", iter, duration());
+      next_report = (iter / _env.reportfreq + 1) * _env.reportfreq;
+      save_lambda_passes();
+      if (_env.lazy_theta > 0)
+	lerr("exact theta refreshes: %lu of %lu", _theta_exact, _theta_all);
+      if (_env.active_set > 0)
+	lerr("frozen individuals: %d of %d", nfrozen(), _n);
+      // the bound needs a consistent model
+      if (_env.compute_logl) {
+	async_pause();
+	logl();
+	async_resume();
+      }
+      if (_env.conv_loci == 0)
+	_hol_wanted = true;
+      else {
+	async_pause();
+	save_model();
+	async_resume();
+      }
+    }
+
+    // the runners only pause while the snapshot is taken and the
+    // model saved, not for the evaluation itself
+    if (_hol_wanted && !_hol_busy) {
+      async_pause();
+      lerr("computing heldout likelihood @ %d secs", duration());
+      start_heldout(false);
+      _hol_wanted = false;
+      lerr("saving theta @ %d secs", duration());
+      save_model();
+      lerr("done @ %d secs", duration());
+      async_resume();
+    }
+  }
+}
+
+void
+SNPSamplingG::async_pause()
+{
+  _async_cm.lock();
+  _async_pause = true;
+  while (_async_paused < _async_runners.size())
+    _async_cm.wait();
+  _async_cm.unlock();
+}
+
+void
+SNPSamplingG::async_resume()
+{
+  _async_cm.lock();
+  _async_pause = false;
+  _async_cm.broadcast();
+  _async_cm.unlock();
+}
+
+// runners park here between loci while the main thread has the
+// model to itself
+void
+SNPSamplingG::async_checkpoint()
+{
+  if (!_async_pause)
+    return;
+  _async_cm.lock();
+  _async_paused++;
+  _async_cm.broadcast();
+  while (_async_pause)
+    _async_cm.wait();
+  _async_paused--;
+  _async_cm.unlock();
+}
+
+void
+SNPSamplingG::async_done()
+{
+  __sync_add_and_fetch(&_iter, 1);
+  __sync_add_and_fetch(&_nloci, 1);
+}
+
+// lambda and beta of a locus have a single writer at a time
+bool
+SNPSamplingG::claim_loc(uint32_t loc)
+{
+  return __sync_bool_compare_and_swap(&_loc_busy[loc], 0, 1);
+}
+
+void
+SNPSamplingG::release_loc(uint32_t loc)
+{
+  __sync_synchronize();
+  _loc_busy[loc] = 0;
+}
+
+LocusRunnerG::LocusRunnerG(const Env &env, uint32_t idx,
+			   uint32_t n, uint32_t k, uint32_t t,
+			   SNPSamplingG &pop)
+  : _env(env), _idx(idx), _n(n), _k(k), _t(t), _pop(pop),
+    _r(gsl_rng_alloc(gsl_rng_default)),
+    _phimom(_n,_k), _phidad(_n,_k), _phinext(_k),
+    _lambdat(_k,_t), _lambdaold(_k,_t), _v(_k,_t), _ebeta(_k,_t),
+    _y(_n)
+{
+  gsl_rng_set(_r, (unsigned long)_env.seed + 1 + _idx);
+}
+
+int
+LocusRunnerG::do_work()
+{
+  do {
+    _pop.async_checkpoint();
+
+    uint32_t loc;
+    do {
+      loc = gsl_rng_uniform_int(_r, _env.l);
+    } while (!_pop.claim_loc(loc));
+
+    _pop.fill_y(loc, _y);
+    optimize_lambda(loc);
+    update_gamma(loc);
+    _pop.release_loc(loc);
+    _pop.async_done();
+  } while (1);
+  return 0;
+}
+
+inline void
+LocusRunnerG::update_phis(uint32_t n, uint32_t loc)
+{
+  const double ** const elogthetad = _pop.Elogtheta().const_data();
+  const double ** const elogbetad = _pop.Elogbeta().const_data()[loc];
+
+  for (uint32_t k = 0; k < _k; ++k)
+    _phinext[k] = elogthetad[n][k] + elogbetad[k][0];
+  _phinext.lognormalize();
+  _phimom.set_elements(n, _phinext);
+
+  for (uint32_t k = 0; k < _k; ++k)
+    _phinext[k] = elogthetad[n][k] + elogbetad[k][1];
+  _phinext.lognormalize();
+  _phidad.set_elements(n, _phinext);
+}
+
+void
+LocusRunnerG::optimize_lambda(uint32_t loc)
 {
   const double **phidadd = _phidad.const_data();
   const double **phimomd = _phimom.const_data();
-  const yval_t * const snpd = _pop.prev_y().const_data();
+  const yval_t * const snpd = _y.const_data();
+  D3 &lambda = _pop.lambda();
+  double **ld = lambda.data()[loc];
+  double **ldt = _lambdat.data();
 
-  debug("updating gamma for loc:%d, y:%s", _loc, _pop.prev_y().s().c_str());
+  for (uint32_t x = 0; x < _env.online_iterations; ++x) {
+    _lambdat.zero();
+    if (_env.active_set > 0)
+      _pop.exp_beta(loc, _ebeta);
+    for (uint32_t n = 0; n < _n; ++n) {
+      if (!_pop.kv_ok(n, loc))
+	continue;
+      if (_pop.frozen(n))
+	_pop.frozen_phis(n, _ebeta, _phimom.data()[n], _phidad.data()[n]);
+      else
+	update_phis(n, loc);
+      for (uint32_t k = 0; k < _k; ++k) {
+	ldt[k][0] += phimomd[n][k] * snpd[n];
+	ldt[k][1] += phidadd[n][k] * (2 - snpd[n]);
+      }
+    }
+
+    _lambdaold.copy_from(loc, lambda);
+    for (uint32_t k = 0; k < _k; ++k) {
+      ld[k][0] = _env.eta0 + ldt[k][0];
+      ld[k][1] = _env.eta1 + ldt[k][1];
+    }
+    _pop.estimate_beta(loc);
+    sub(loc, lambda, _lambdaold, _v);
+
+    if (_pop.lambda_converged(loc, _v) || x + 1 == _env.online_iterations) {
+      _pop.count_passes(x + 1);
+      break;
+    }
+  }
+}
+
+// racy by design: another runner may update the same individual at
+// the same time, and one of the two updates can be lost
+void
+LocusRunnerG::update_gamma(uint32_t loc)
+{
+  const double **phidadd = _phidad.const_data();
+  const double **phimomd = _phimom.const_data();
+  const yval_t * const snpd = _y.const_data();
 
   double gamma_scale = _env.l;
   double **gd = _pop.gamma().data();
 
-  // no locking needed
-  // each thread owns it's own set of indivs
-  for (uint32_t i = 0; i < indivs.size(); ++i) {
-    uint32_t n = indivs[i];
-    if (!_pop.kv_ok(n, _loc))
+  uint32_t exact = 0, all = 0;
+  for (uint32_t n = 0; n < _n; ++n) {
+    if (!_pop.kv_ok(n, loc) || !_pop.gamma_due(n))
       continue;
 
-    _pop.update_rho_indiv(n);
     yval_t y = snpd[n];
+    double *g = _phinext.data();
+    for (uint32_t k = 0; k < _k; ++k)
+      g[k] = _pop.alpha(k) + 
+	(gamma_scale * (y * phimomd[n][k] + (2 - y) * phidadd[n][k])) - gd[n][k];
+    // -adaptive-rho is rejected with -async-groups: its per-individual
+    // state is not safe to update from several runners at once
+    double rho = _pop.next_rho_indiv(n);
+
     for (uint32_t k = 0; k < _k; ++k) {
-      gd[n][k] += _pop.rho_indiv(n) *					\
-	(_pop.alpha(k) + (gamma_scale * (y * phimomd[n][k] + (2 - y) * phidadd[n][k])) - gd[n][k]);
+      g[k] *= rho;
+      gd[n][k] += g[k];
     }
+    if (_pop.update_theta(n, g))
+      exact++;
+    _pop.track_change(n, g);
+    all++;
   }
+  _pop.count_theta(exact, all);
 }
 
 void
-PhiRunnerG::estimate_theta(const IndivsList &indivs)
+PhiRunnerG::update_gamma(const IndivsList &indivs)
 {
-  const double ** const gd = _pop.gamma().const_data();
-  double **theta = _pop.Etheta().data();
-  double **elogtheta = _pop.Elogtheta().data();
-  
-  for (uint32_t i = 0; i < indivs.size(); ++i)  {
+  const double **phidadd = _phidad.const_data();
+  const double **phimomd = _phimom.const_data();
+  const yval_t * const snpd = _pop.prev_y().const_data();
+
+  uint32_t loc = _pop.gamma_loc();
+  debug("updating gamma for loc:%d, y:%s", loc, _pop.prev_y().s().c_str());
+
+  double gamma_scale = _env.l;
+  double **gd = _pop.gamma().data();
+
+  // no locking needed
+  // each tile is processed by exactly one thread per pass; theta
+  // only changes for individuals whose gamma moved
+  if (_pop.topm()) {
+    for (uint32_t i = 0; i < indivs.size(); ++i) {
+      uint32_t n = indivs[i];
+      if (!_pop.kv_ok(n, loc) || !_pop.gamma_due(n))
+	continue;
+      _pop.update_rho_indiv(n);
+      _pop.topm_update(n, snpd[n], phimomd[n], phidadd[n],
+		       _pop.rho_indiv(n));
+    }
+    return;
+  }
+
+  uint32_t exact = 0, all = 0;
+  for (uint32_t i = 0; i < indivs.size(); ++i) {
     uint32_t n = indivs[i];
-    double s = .0;
+    if (!_pop.kv_ok(n, loc) || !_pop.gamma_due(n))
+      continue;
+
+    yval_t y = snpd[n];
+    double *g = _phinext.data();
     for (uint32_t k = 0; k < _k; ++k)
-      s += gd[n][k];
-    assert(s);
-    double psi_sum = gsl_sf_psi(s);
+      g[k] = _pop.alpha(k) + (gamma_scale * (y * phimomd[n][k] + (2 - y) * phidadd[n][k])) - gd[n][k];
+
+    double rho;
+    if (_pop.adaptive_rho())
+      rho = _pop.adaptive_rho(n, g);
+    else {
+      _pop.update_rho_indiv(n);
+      rho = _pop.rho_indiv(n);
+    }
     for (uint32_t k = 0; k < _k; ++k) {
-      theta[n][k] = gd[n][k] / s;
-      elogtheta[n][k] = gsl_sf_psi(gd[n][k]) - psi_sum;
+      g[k] *= rho;
+      gd[n][k] += g[k];
     }
+    if (_pop.update_theta(n, g))
+      exact++;
+    _pop.track_change(n, g);
+    all++;
   }
+  _pop.count_theta(exact, all);
 }
 
 void
@@ -825,6 +1985,20 @@ PhiRunnerG::update_lambda_t(const IndivsList &indivs)
   const yval_t * const snpd = _pop.y().const_data();
 
   double **ldt = _lambdat.data();
+  if (_pop.topm()) {
+    uint32_t m = _env.topm;
+    for (uint32_t i = 0; i < indivs.size(); ++i) {
+      uint32_t n = indivs[i];
+      if (!_pop.kv_ok(n, _loc))
+	continue;
+      const uint32_t * const idx = _pop.support(n);
+      for (uint32_t j = 0; j < m; ++j) {
+	ldt[idx[j]][0] += phimomd[n][j] * snpd[n];
+	ldt[idx[j]][1] += phidadd[n][j] * (2 - snpd[n]);
+      }
+    }
+    return;
+  }
   for (uint32_t k = 0; k < _k; ++k) {
     for (uint32_t i = 0; i < indivs.size(); ++i)  {
       uint32_t n = indivs[i];
@@ -836,27 +2010,278 @@ PhiRunnerG::update_lambda_t(const IndivsList &indivs)
   }
 }
 
+// -locus-batch: with t_n = exp(Elogtheta_n) and b_j the rows of
+// exp(Elogbeta), phi_nk at locus column j is t_nk b_jk / (t_n . b_j),
+// so for a tile
+//   Z = T B'          (individuals x 2B)
+//   W = y / Z         (zero at missing and heldout pairs)
+//   lambda_t = T' W   (K x 2B, times b_jk by the main thread)
+// and the gamma step is t_nk (W B)_nk, summed over the batch
 void
-SNPSamplingG::save_beta()
+PhiRunnerG::process_batch(const IndivsList &v, bool apply_gamma)
 {
-  const double **ebeta = _Ebeta.const_data();
-  FILE *f = fopen(add_iter_suffix("/beta").c_str(), "w");
-  if (!f)  {
-    lerr("cannot open beta or lambda file:%s\n",  strerror(errno));
-    exit(-1);
+  uint32_t nb = _pop.nbatch(), nc = _t * nb, rows = v.size();
+  uint32_t n0 = v[0];
+  assert (v[rows - 1] + 1 - n0 == rows);
+
+  if (apply_gamma)
+    update_gamma_batch(v);
+  if (_pop.sim_y())
+    _pop.sim_batch_tile(v);
+
+  double *et = _pop.batch_etheta(n0);
+  if (_pop.batch_first()) {
+    const double ** const elogthetad = _pop.Elogtheta().const_data();
+    for (uint32_t r = 0; r < rows; ++r)
+      for (uint32_t k = 0; k < _k; ++k)
+	et[r * _k + k] = exp(elogthetad[n0 + r][k]);
   }
-  for (uint32_t l = 0; l < _l; ++l) {
-    fprintf(f, "%d\t", l);
+
+  _bz.resize((size_t)rows * nc);
+  cblas_dgemm(CblasRowMajor, CblasNoTrans, CblasTrans,
+	      rows, nc, _k, 1.0, et, _k, _pop.batch_eb(), _k,
+	      0.0, &_bz[0], nc);
+
+  double *w = _pop.batch_w(n0);
+  for (uint32_t b = 0; b < nb; ++b) {
+    uint32_t loc = _pop.batch_loc(b);
+    const yval_t * const yd = _pop.batch_y(b).const_data();
+    for (uint32_t r = 0; r < rows; ++r) {
+      double *wr = w + r * nc + b * _t;
+      if (!_pop.kv_ok(n0 + r, loc)) {
+	wr[0] = wr[1] = .0;
+	continue;
+      }
+      const double *zr = &_bz[r * nc + b * _t];
+      yval_t y = yd[n0 + r];
+      wr[0] = y / (zr[0] < 1e-300 ? 1e-300 : zr[0]);
+      wr[1] = (2 - y) / (zr[1] < 1e-300 ? 1e-300 : zr[1]);
+    }
+  }
+
+  _blt.resize((size_t)_k * nc);
+  cblas_dgemm(CblasRowMajor, CblasTrans, CblasNoTrans,
+	      _k, nc, rows, 1.0, et, _k, w, nc,
+	      0.0, &_blt[0], nc);
+  double **ldt = _lambdat.data();
+  for (uint32_t k = 0; k < _k; ++k)
+    for (uint32_t j = 0; j < nc; ++j)
+      ldt[k][j] = _blt[k * nc + j];
+}
+
+// one step for the whole batch, scaled by L/B; the weights and
+// exp(Elogtheta) are still those of the last pass over it
+void
+PhiRunnerG::update_gamma_batch(const IndivsList &v)
+{
+  uint32_t nb = _pop.nbatch(), nc = _t * nb, rows = v.size();
+  uint32_t n0 = v[0];
+  double gamma_scale = (double)_env.l / nb;
+  double **gd = _pop.gamma().data();
+
+  const double *et = _pop.batch_etheta(n0);
+  _bh.resize((size_t)rows * _k);
+  cblas_dgemm(CblasRowMajor, CblasNoTrans, CblasNoTrans,
+	      rows, _k, nc, 1.0, _pop.batch_w(n0), nc,
+	      _pop.batch_prev_eb(), _k, 0.0, &_bh[0], _k);
+
+  uint32_t exact = 0, all = 0;
+  for (uint32_t r = 0; r < rows; ++r) {
+    uint32_t n = n0 + r;
+    if (!_pop.gamma_due(n))
+      continue;
+    double *g = _phinext.data();
+    for (uint32_t k = 0; k < _k; ++k)
+      g[k] = _pop.alpha(k) + gamma_scale * et[r * _k + k] * _bh[r * _k + k]
+	- gd[n][k];
+
+    double rho;
+    if (_pop.adaptive_rho())
+      rho = _pop.adaptive_rho(n, g);
+    else {
+      _pop.update_rho_indiv(n);
+      rho = _pop.rho_indiv(n);
+    }
     for (uint32_t k = 0; k < _k; ++k) {
-      fprintf(f, "%.8f\t", ebeta[l][k]);
+      g[k] *= rho;
+      gd[n][k] += g[k];
     }
-    fprintf(f, "\n");
+    if (_pop.update_theta(n, g))
+      exact++;
+    all++;
   }
-  fclose(f);
+  _pop.count_theta(exact, all);
+}
+
+HeldoutRunnerG::HeldoutRunnerG(const Env &env, 
+			       uint32_t n, uint32_t k, uint32_t t,
+			       SNPSamplingG &pop, int cpu)
+  : _env(env), _n(n), _k(k), _t(t), _pop(pop), _cpu(cpu),
+    _lambda(_k,_t), _lambdat(_k,_t), _lambdaold(_k,_t), _v(_k,_t),
+    _elogbeta(_k,_t), _beta(_k), _phinext(_k),
+    _y(_n), _holike(_k)
+{
 }
 
+int
+HeldoutRunnerG::do_work()
+{
+  if (_cpu >= 0 && pin(_cpu) < 0)
+    lerr("heldout runner: cannot pin to cpu %d", _cpu);
+  uint32_t gen = 0;
+  do {
+    _pop.heldout_wait(gen);
+    uint32_t i = 0;
+    while (_pop.heldout_claim(i))
+      _pop.heldout_done(i, snp_likelihood(i));
+  } while (1);
+  return 0;
+}
+
+void
+HeldoutRunnerG::estimate_beta()
+{
+  const double **ld = _lambda.const_data();
+  double **elogbeta = _elogbeta.data();
+  for (uint32_t k = 0; k < _k; ++k) {
+    double s = .0;
+    for (uint32_t t = 0; t < _t; ++t)
+      s += ld[k][t];
+    _beta[k] = ld[k][0] / s;
+    
+    double psi_sum = gsl_sf_psi(s);
+    elogbeta[k][0] = gsl_sf_psi(ld[k][0]) - psi_sum;
+    elogbeta[k][1] = gsl_sf_psi(ld[k][1]) - psi_sum;
+  }
+}
+
+// SNPSamplingG::optimize_lambda() for one locus, at most `passes`
+// passes on this runner's copy of its lambda
 void
-SNPSamplingG::save_beta(const vector<uint32_t> &locs)
+HeldoutRunnerG::fit_lambda(uint32_t loc, const Matrix &elogtheta,
+			   uint32_t passes)
+{
+  const double ** const elogthetad = elogtheta.const_data();
+  const double ** const elogbetad = _elogbeta.const_data();
+  const yval_t * const snpd = _y.const_data();
+  double **ld = _lambda.data();
+  double **ldt = _lambdat.data();
+
+  for (uint32_t x = 0; x < passes; ++x) {
+    _lambdat.zero();
+    for (uint32_t n = 0; n < _n; ++n) {
+      if (!_pop.kv_ok(n, loc))
+	continue;
+      for (uint32_t k = 0; k < _k; ++k)
+	_phinext[k] = elogthetad[n][k] + elogbetad[k][0];
+      _phinext.lognormalize();
+      for (uint32_t k = 0; k < _k; ++k)
+	ldt[k][0] += _phinext[k] * snpd[n];
+
+      for (uint32_t k = 0; k < _k; ++k)
+	_phinext[k] = elogthetad[n][k] + elogbetad[k][1];
+      _phinext.lognormalize();
+      for (uint32_t k = 0; k < _k; ++k)
+	ldt[k][1] += _phinext[k] * (2 - snpd[n]);
+    }
+
+    _lambdaold.copy_from(_lambda);
+    for (uint32_t k = 0; k < _k; ++k) {
+      ld[k][0] = _env.eta0 + ldt[k][0];
+      ld[k][1] = _env.eta1 + ldt[k][1];
+    }
+    estimate_beta();
+    sub(_lambda, _lambdaold, _v);
+
+    // relative, as SNPSamplingG::lambda_converged(): lambda grows
+    // with the number of individuals
+    double lsum = .0;
+    for (uint32_t k = 0; k < _k; ++k)
+      for (uint32_t t = 0; t < _t; ++t)
+	lsum += ld[k][t];
+    if (_v.abs_mean() < _env.lambda_reltol * lsum / (_k * _t))
+      break;
+  }
+}
+
+double
+HeldoutRunnerG::snp_likelihood(uint32_t i)
+{
+  const HeldoutLocG &h = _pop.heldout_loc(i);
+  uint32_t passes = _pop.hol_first() ? 0 : _env.online_iterations;
+  return score(h, _pop.hol_lambda().const_data()[i], NULL,
+	       _pop.hol_Etheta(), _pop.hol_Elogtheta(), passes);
+}
+
+// fit locus h's lambda starting from lambda_in, score its heldout
+// individuals and, given lambda_out, leave the fitted lambda there
+double
+HeldoutRunnerG::score(const HeldoutLocG &h,
+		      const double * const *lambda_in, double **lambda_out,
+		      const Matrix &theta, const Matrix &elogtheta,
+		      uint32_t passes)
+{
+  fit_locus(h.loc, lambda_in, lambda_out, elogtheta, passes);
+  return _holike.score(theta.const_data(), _beta.const_data(), h.indivs, 
+		       _y.const_data());
+}
+
+// fit locus loc's lambda starting from lambda_in and, given
+// lambda_out, leave the fitted lambda there
+void
+HeldoutRunnerG::fit_locus(uint32_t loc,
+			  const double * const *lambda_in, double **lambda_out,
+			  const Matrix &elogtheta, uint32_t passes)
+{
+  _pop.fill_y(loc, _y);
+
+  double **ld = _lambda.data();
+  for (uint32_t k = 0; k < _k; ++k)
+    for (uint32_t t = 0; t < _t; ++t)
+      ld[k][t] = lambda_in[k][t];
+  estimate_beta();
+  fit_lambda(loc, elogtheta, passes);
+  if (lambda_out)
+    for (uint32_t k = 0; k < _k; ++k)
+      for (uint32_t t = 0; t < _t; ++t)
+	lambda_out[k][t] = ld[k][t];
+}
+
+// the first pass starts from the prior, whose Elogbeta is the same
+// for every population and so leaves the phis to theta alone
+BetaRunnerG::BetaRunnerG(const Env &env,
+			 uint32_t n, uint32_t k, uint32_t t,
+			 SNPSamplingG &pop)
+  : HeldoutRunnerG(env, n, k, t, pop),
+    _env(env), _pop(pop), _prior(k,t)
+{
+  double **pd = _prior.data();
+  for (uint32_t i = 0; i < k; ++i) {
+    pd[i][0] = _env.eta0;
+    pd[i][1] = _env.eta1;
+  }
+}
+
+int
+BetaRunnerG::do_work()
+{
+  uint32_t i = 0;
+  while (_pop.beta_claim(i))
+    fit(i);
+  return 0;
+}
+
+void
+BetaRunnerG::fit(uint32_t i)
+{
+  uint32_t loc = _pop.beta_loc(i);
+  fit_locus(loc, _prior.const_data(), _pop.lambda().data()[loc],
+	    _pop.Elogtheta(), _env.online_iterations);
+  _pop.beta_done(i, beta());
+}
+
+void
+SNPSamplingG::save_beta()
 {
   const double **ebeta = _Ebeta.const_data();
   FILE *f = fopen(add_iter_suffix("/beta").c_str(), "w");
@@ -864,24 +2289,25 @@ SNPSamplingG::save_beta(const vector<uint32_t> &locs)
     lerr("cannot open beta or lambda file:%s\n",  strerror(errno));
     exit(-1);
   }
-  for (uint32_t i = 0; i < locs.size(); ++i) {
-    uint32_t loc = locs[i];
-    fprintf(f, "%d\t", loc);
+  for (uint32_t l = 0; l < _l; ++l) {
+    fprintf(f, "%d\t", l);
     for (uint32_t k = 0; k < _k; ++k) {
-      fprintf(f, "%.8f\t", ebeta[loc][k]);
+      fprintf(f, "%.8f\t", ebeta[l][k]);
     }
     fprintf(f, "\n");
   }
   fclose(f);
 }
 
-void
-SNPSamplingG::load_gamma()
+// reads the rows of a gamma.txt into the first rows of gamma and
+// returns how many there were
+uint32_t
+SNPSamplingG::load_gamma(string fname)
 {
   double **gammad = _gamma.data();
-  FILE *gammaf = fopen("gamma.txt", "r");
+  FILE *gammaf = fopen(fname.c_str(), "r");
   if (!gammaf)  {
-    lerr("cannot open gamma file:%s\n",  strerror(errno));
+    lerr("cannot open gamma file %s:%s\n", fname.c_str(), strerror(errno));
     exit(-1);
   }
 
@@ -891,6 +2317,10 @@ SNPSamplingG::load_gamma()
   while (!feof(gammaf)) {
     if (fgets(line, sz, gammaf) == NULL) 
       break;
+    if (n >= _n) {
+      lerr("error: %s has more than %d individuals", fname.c_str(), _n);
+      exit(-1);
+    }
     
     uint32_t k = 0;
     char *p = line;
@@ -917,8 +2347,8 @@ SNPSamplingG::load_gamma()
     n++;
     memset(line, 0, sz);
   }
-  assert (n = _n);
   fclose(gammaf);
+  free(line);
 
   FILE *f = fopen(Env::file_str("gammasave.txt").c_str(), "w");
   if (!f)  {
@@ -943,4 +2373,94 @@ SNPSamplingG::load_gamma()
     fprintf(f,"%d\n", max_k);
   }
   fclose(f);
+  return n;
+}
+
+void
+SNPSamplingG::save_lambda()
+{
+  const double ***ld = _lambda.const_data();
+  FILE *f = fopen(add_iter_suffix("/lambda").c_str(), "w");
+  if (!f)  {
+    lerr("cannot open lambda file:%s\n",  strerror(errno));
+    exit(-1);
+  }
+  for (uint32_t l = 0; l < _l; ++l) {
+    fprintf(f, "%d\t", l);
+    for (uint32_t k = 0; k < _k; ++k)
+      for (uint32_t t = 0; t < _t; ++t)
+	fprintf(f, "%.8f\t", ld[l][k][t]);
+    fprintf(f, "\n");
+  }
+  fclose(f);
+}
+
+// rows of a lambda.txt written by save_lambda(); loci not in the
+// file keep their prior
+void
+SNPSamplingG::load_lambda(string fname)
+{
+  FILE *f = fopen(fname.c_str(), "r");
+  if (!f)  {
+    lerr("cannot open lambda file %s:%s\n", fname.c_str(), strerror(errno));
+    exit(-1);
+  }
+  double ***ld = _lambda.data();
+  uint32_t loc = 0, nread = 0;
+  while (fscanf(f, "%d", &loc) == 1) {
+    if (loc >= _l) {
+      lerr("error: locus %d in %s is out of range", loc, fname.c_str());
+      exit(-1);
+    }
+    for (uint32_t k = 0; k < _k; ++k)
+      for (uint32_t t = 0; t < _t; ++t)
+	if (fscanf(f, "%lf", &ld[loc][k][t]) != 1) {
+	  lerr("error parsing %s at locus %d", fname.c_str(), loc);
+	  exit(-1);
+	}
+    nread++;
+  }
+  fclose(f);
+  PopLib::set_dir_exp(_lambda, _Elogbeta);
+  lerr("loaded lambda at %d of %d loci from %s", nread, _l, fname.c_str());
+}
+
+// -incremental DIR: continue the fit in DIR, whose individuals are
+// the first rows here.  their gamma, and lambda if DIR has one
+// (-save-beta), are loaded; the new rows keep their random start.
+// until incremental_warmup loci have been seen only the new rows
+// move, then all of them do.  the old rows have been through the
+// data before, so their step-size counts start at one pass over the
+// loci rather than at a full step
+void
+SNPSamplingG::init_incremental()
+{
+  const string &dir = _env.incremental;
+  uint32_t nold = load_gamma(dir + "/gamma.txt");
+  if (nold == 0) {
+    lerr("error: no individuals in %s/gamma.txt", dir.c_str());
+    exit(-1);
+  }
+  string lf = dir + "/lambda.txt";
+  if (access(lf.c_str(), R_OK) == 0)
+    load_lambda(lf);
+  PopLib::set_dir_exp(_gamma, _Elogtheta);
+
+  for (uint32_t n = 0; n < nold; ++n)
+    _c_indiv[n] = _l;
+  if (nold < _n) {
+    _incr_hold = nold;
+    _incr_until = _env.incremental_warmup;
+  }
+  Env::plog("incremental: previous individuals", nold);
+  Env::plog("incremental: new individuals", _n - nold);
+  lerr("incremental: %d previous and %d new individuals", nold, _n - nold);
+}
+
+void
+SNPSamplingG::incr_release()
+{
+  lerr("incremental: releasing the %d previous individuals after %lu loci",
+       _incr_hold, _nloci);
+  _incr_hold = 0;
 }
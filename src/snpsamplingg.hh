@@ -13,11 +13,19 @@
 #include "snp.hh"
 #include "thread.hh"
 #include "tsqueue.hh"
+#include "tsreduce.hh"
+#include "tilesched.hh"
+#include "topology.hh"
+#include "holike.hh"
+#include "elbo.hh"
+#include "stepsize.hh"
+#include "locsched.hh"
 
 #include <gsl/gsl_rng.h>
 #include <gsl/gsl_randist.h>
 #include <gsl/gsl_sf_psi.h>
 #include <gsl/gsl_sf.h>
+#include <gsl/gsl_cblas.h>
 
 typedef vector<uint32_t> IndivsList;
 typedef std::map<uint32_t, IndivsList *> ChunkMap;
@@ -26,27 +34,28 @@ class PhiRunnerG : public Thread {
 public:
   PhiRunnerG(const Env &env, gsl_rng **r, 
 	     const uint32_t &iter,
-	     const uint32_t &x,
+		     const uint32_t &x,
+	     uint32_t idx, int cpu,
 	     uint32_t n, uint32_t k, 
 	     uint32_t loc, uint32_t t, 
 	     const SNP &snp, 
 	     SNPSamplingG &pop,
+	     Matrix &phimom, Matrix &phidad,
 	     TSQueue<IndivList> &out_q,
 	     TSQueue<pthread_t> &in_q,
 	     CondMutex &cm)
     : _env(env), _r(r), _iter(iter), _x(x),
       _prev_iter(0),
       _prev_x(0), 
-      _prev_hol_mode(false),
+      _idx(idx), _cpu(cpu),
       _n(n), _k(k), _loc(loc), _t(t),
-      _phidad(_n,_k), _phimom(_n,_k),
-      _phinext(_k), _lambdat(_k,_t),
+      _phidad(phidad), _phimom(phimom),
+      _phinext(_k), _lambdat(_k,_t * (env.locus_batch > 1 ? env.locus_batch : 1)), _ebeta(_k,_t),
       _snp(snp), 
       _pop(pop),
       _out_q(out_q),
       _in_q(in_q),
       _cm(cm),
-      _oldilist(NULL),
       _idptr(NULL)
   { }
   ~PhiRunnerG() { if (_idptr) { delete _idptr; } } 
@@ -66,9 +75,9 @@ public:
 
   void update_gamma(const IndivsList &i);
   void update_lambda_t(const IndivsList &i);
-  void estimate_theta(const IndivsList &i);
-  void update_gamma();
-  void estimate_theta();
+
+  void process_batch(const IndivsList &v, bool apply_gamma);
+  void update_gamma_batch(const IndivsList &v);
 
 private:
   const Env &_env;
@@ -77,17 +86,24 @@ private:
   const uint32_t &_x;
   uint32_t _prev_iter;
   uint32_t _prev_x;
-  bool _prev_hol_mode;
+  uint32_t _idx;
+  int _cpu;
 
   uint32_t _n;
   uint32_t _k;
   uint32_t _loc;
   uint32_t _t;
 
-  Matrix _phidad;
-  Matrix _phimom;
+  // shared, indexed by individual; a tile's rows are only
+  // touched by the thread currently processing that tile
+  Matrix &_phidad;
+  Matrix &_phimom;
   Array _phinext;
   Matrix _lambdat;
+  Matrix _ebeta;
+  vector<double> _bz;		// -locus-batch scratch
+  vector<double> _bh;
+  vector<double> _blt;
 
   const SNP &_snp;
   SNPSamplingG &_pop;
@@ -95,11 +111,126 @@ private:
   TSQueue<IndivsList> &_out_q;
   TSQueue<pthread_t> &_in_q;
   CondMutex &_cm;
-  IndivsList *_oldilist;
   pthread_t *_idptr;
 };
 typedef std::map<pthread_t, PhiRunnerG *> ThreadMapG;
 
+// asynchronous mode: each runner is one thread that samples its own
+// locus, optimizes its lambda over all individuals and applies the
+// gamma updates to the shared state without locks (hogwild); many
+// loci are in flight at once and nobody waits on a per-pass barrier.
+// a locus is not split across threads, so -async-groups G runs G
+// threads and the phi workers are not started
+class LocusRunnerG : public Thread {
+public:
+  LocusRunnerG(const Env &env, uint32_t idx,
+	       uint32_t n, uint32_t k, uint32_t t,
+	       SNPSamplingG &pop);
+  ~LocusRunnerG() { gsl_rng_free(_r); }
+
+  int do_work();
+
+private:
+  void optimize_lambda(uint32_t loc);
+  void update_gamma(uint32_t loc);
+  void update_phis(uint32_t n, uint32_t loc);
+
+  const Env &_env;
+  uint32_t _idx;
+  uint32_t _n;
+  uint32_t _k;
+  uint32_t _t;
+  SNPSamplingG &_pop;
+  gsl_rng *_r;
+
+  Matrix _phimom;
+  Matrix _phidad;
+  Array _phinext;
+  Matrix _lambdat;
+  Matrix _lambdaold;
+  Matrix _v;
+  Matrix _ebeta;
+  YArray _y;
+};
+
+// a heldout locus and the individuals held out at it
+struct HeldoutLocG {
+  uint32_t loc;
+  bool validation;
+  IndivsList indivs;
+};
+
+// -topm: an individual's gamma steps since its support was last
+// chosen shrink gamma - alpha off the support by the product of their
+// (1 - rho); with the sums of alpha and of gamma - alpha off the
+// support when it was chosen, that gives gamma's total in O(1)
+struct TopMState {
+  double scale;
+  double aoff;
+  double boff;
+  uint32_t age;
+};
+
+// background heldout evaluation: runners claim heldout loci one at a
+// time, fit the locus' lambda against a snapshot of theta taken when
+// the evaluation was posted, and score its heldout individuals.  the
+// shared model is never written, so inference keeps going meanwhile
+class HeldoutRunnerG : public Thread {
+public:
+  HeldoutRunnerG(const Env &env, uint32_t n, uint32_t k, uint32_t t,
+		 SNPSamplingG &pop, int cpu = -1);
+
+  int do_work();
+  double score(const HeldoutLocG &h, 
+	       const double * const *lambda_in, double **lambda_out,
+	       const Matrix &theta, const Matrix &elogtheta,
+	       uint32_t passes);
+  void fit_locus(uint32_t loc,
+		 const double * const *lambda_in, double **lambda_out,
+		 const Matrix &elogtheta, uint32_t passes);
+  const Array &beta() const { return _beta; }
+
+private:
+  double snp_likelihood(uint32_t i);
+  void fit_lambda(uint32_t loc, const Matrix &elogtheta,
+		  uint32_t passes);
+  void estimate_beta();
+
+  const Env &_env;
+  uint32_t _n;
+  uint32_t _k;
+  uint32_t _t;
+  SNPSamplingG &_pop;
+  int _cpu;
+
+  Matrix _lambda;
+  Matrix _lambdat;
+  Matrix _lambdaold;
+  Matrix _v;
+  Matrix _elogbeta;
+  Array _beta;
+  Array _phinext;
+  YArray _y;
+  HOLikelihood _holike;
+};
+
+// -compute-beta: with theta fixed the loci are independent, so each
+// runner claims whole loci and fits them start to finish on its own,
+// with no barrier between passes
+class BetaRunnerG : public HeldoutRunnerG {
+public:
+  BetaRunnerG(const Env &env, uint32_t n, uint32_t k, uint32_t t,
+	      SNPSamplingG &pop);
+
+  int do_work();
+  void fit(uint32_t i);
+
+private:
+  const Env &_env;
+  SNPSamplingG &_pop;
+  Matrix _prior;
+};
+
 class SNPSamplingG {
 public:
   SNPSamplingG(Env &env, SNP &snp);
@@ -109,7 +240,10 @@ public:
   bool kv_ok(uint32_t indiv, uint32_t loc) const;
   void load_model(string betafile = "", string thetafile = "");
   void snp_likelihood(uint32_t loc, uint32_t n, Array &p);
-  bool hol_mode() const { return _hol_mode; }
+  bool apply_gamma() const { return _apply_gamma; }
+  bool sim_y() const { return _sim_y; }
+  void sim_tile(const IndivsList &tile);
+  uint32_t gamma_loc() const { return _gamma_loc; }
 
   const uArray& shuffled_nodes() const { return _shuffled_nodes; }
 
@@ -127,8 +261,36 @@ public:
   Matrix &Elogtheta()  { return _Elogtheta; }
 
   void update_rho_indiv(uint32_t n);
+  double next_rho_indiv(uint32_t n);
   const double alpha(uint32_t k) const     { return _alpha[k]; }
+  const Matrix &eta() const { return _eta; }
   const double rho_indiv(uint32_t n) const { return _rho_indiv[n]; }
+  bool adaptive_rho() const { return _adapt_rho != NULL; }
+  double adaptive_rho(uint32_t n, const double *g) { return _adapt_rho->next(n, g); }
+  bool update_theta(uint32_t n, const double *step);
+  void count_theta(uint32_t exact, uint32_t all);
+  bool gamma_due(uint32_t n) const;
+  bool frozen(uint32_t n) const { return _frozen && _frozen[n]; }
+  void track_change(uint32_t n, const double *step);
+  void exp_beta(uint32_t loc, Matrix &ebeta) const;
+  void frozen_phis(uint32_t n, const Matrix &ebeta,
+		   double *phimom, double *phidad) const;
+  bool topm() const { return _topm_idx != NULL; }
+  const uint32_t *support(uint32_t n) const { return _topm_idx->const_data()[n]; }
+  void topm_phis(uint32_t n, uint32_t loc,
+		 double *phimom, double *phidad) const;
+  void topm_update(uint32_t n, yval_t y, const double *phimom,
+		   const double *phidad, double rho);
+
+  uint32_t nbatch() const { return _env.locus_batch > 1 ? _env.locus_batch : 1; }
+  bool batch_first() const { return _batch_first; }
+  uint32_t batch_loc(uint32_t b) const { return _batch_locs[b]; }
+  const YArray &batch_y(uint32_t b) const { return *_batch_y[b]; }
+  double *batch_etheta(uint32_t n) { return &_batch_et[(size_t)n * _k]; }
+  double *batch_w(uint32_t n) { return &_batch_w[(size_t)n * _t * nbatch()]; }
+  const double *batch_eb() const { return &_batch_eb[0]; }
+  const double *batch_prev_eb() const { return &_batch_prev_eb[0]; }
+  void sim_batch_tile(const IndivsList &tile);
 
   YArray &y() { return *_y; }
   const YArray &y() const { return *_y; }
@@ -136,6 +298,35 @@ public:
   YArray &prev_y() { return *_prev_y; }
   const YArray &prev_y() const { return *_prev_y; }
 
+  TSReduce &lambdat_reduce() { return *_lambdat_reduce; }
+  TileScheduler &tile_sched() { return _tile_sched; }
+  const IndivsList &tile(uint32_t t) const { return *_tiles[t]; }
+  void first_touch(uint32_t chunk);
+
+  void estimate_beta(uint32_t loc);
+  void fill_y(uint32_t loc, YArray &y);
+  bool lambda_converged(uint32_t loc, const Matrix &v) const;
+  void count_passes(uint32_t x) { __sync_fetch_and_add(&_lambda_passes[x], 1); }
+  bool claim_loc(uint32_t loc);
+  void release_loc(uint32_t loc);
+  void async_checkpoint();
+  void async_done();
+
+  const HeldoutLocG &heldout_loc(uint32_t i) const { return _hol_locs[i]; }
+  const Matrix &hol_Etheta() const    { return _hol_Etheta; }
+  const Matrix &hol_Elogtheta() const { return _hol_Elogtheta; }
+  const D3 &hol_lambda() const        { return *_hol_lambda; }
+  bool hol_first() const              { return _hol_first; }
+  void heldout_wait(uint32_t &gen);
+  bool heldout_claim(uint32_t &i);
+  void heldout_done(uint32_t i, double lsum);
+  bool beta_claim(uint32_t &i);
+  uint32_t beta_loc(uint32_t i) const { return _beta_locs[i]; }
+  void beta_done(uint32_t i, const Array &beta);
+
+  // philox domain of the streaming check's locus draws; see snp.hh
+  static const uint32_t CHECK_STREAM = 6;
+
 private:
   void init_heldout_sets();
   void set_test_sample();
@@ -148,23 +339,46 @@ private:
   void update_phimom(uint32_t n, uint32_t loc);
   void update_phidad(uint32_t n, uint32_t loc);
   void optimize_lambda(uint32_t loc);
+  void run_pass();
+  void init_batch();
+  void get_batch();
+  uint32_t next_loc();
+  void optimize_batch();
+  void infer_async();
+  void async_pause();
+  void async_resume();
 
-  void estimate_beta(uint32_t loc);
   double logl();
 
-  void compute_all_lambda();
-  void compute_and_save_beta();
+  void compute_beta(const vector<uint32_t> &locs);
   void save_beta();
-  void save_beta(const vector<uint32_t> &locs);
   void save_gamma();
   void save_model();
-  void load_gamma();
+  void save_lambda_passes();
+  uint32_t nfrozen() const;
+  void init_topm();
+  void topm_refresh(uint32_t n);
+  void topm_flush();
+  uint32_t load_gamma(string fname);
+  void save_lambda();
+  void load_lambda(string fname);
+  void init_incremental();
+  void incr_release();
   void compute_lambda();
   void estimate_all_beta();
 
   int start_threads();
   void split_all_indivs();
-  double compute_likelihood(bool first, bool validation);
+  uint32_t tile_size() const;
+  void init_heldout_locs();
+  int start_heldout_threads();
+  void start_heldout(bool first);
+  void wait_heldout();
+  void finish_heldout();
+  void report_likelihood(bool validation, double s, uint32_t k);
+  void init_stream_check();
+  void stream_check(uint32_t nloci);
+  void stream_sweep();
 
   void init_gamma();
   void init_lambda();
@@ -181,7 +395,6 @@ private:
   double approx_log_likelihood();
   double logcoeff(yval_t x);
   
-  double snp_likelihood(uint32_t loc, vector<uint32_t> &indiv, bool first = false);
   void estimate_pi(uint32_t p, Array &pi_p) const;
   void shuffle_nodes();
 
@@ -223,6 +436,49 @@ private:
 
   Array _rho_indiv;
   uArray _c_indiv;
+  RhoTable _rho_indiv_table;
+  AdaptiveRho *_adapt_rho;
+
+  // -lazy-theta: updates since the last exact Elogtheta and the
+  // sum of squared relative steps of gamma over them, per individual;
+  // and how many
+  // updates recomputed the digammas
+  uArray *_theta_age;
+  Array *_theta_drift;
+  uint64_t _theta_exact;
+  uint64_t _theta_all;
+
+  // -active-set: moving average of each individual's relative gamma
+  // step, whether it is frozen, and exp(Elogtheta) of frozen rows
+  Array *_act_change;
+  uint8_t *_frozen;
+  Matrix *_act_etheta;
+
+  // -topm: each individual's m populations with the largest gamma
+  // (hence Elogtheta); its phis live in the first m columns of the
+  // phi rows, in this order
+  D2Array<uint32_t> *_topm_idx;
+  vector<TopMState> _topm_state;
+
+  // -locus-batch B: the batch's loci, their genotypes and which are
+  // simulated by the workers (with their rows of beta); exp(Elogbeta)
+  // of the b-th locus as rows 2b and 2b+1, for the current pass and
+  // for the last pass over the previous batch; and per individual
+  // exp(Elogtheta) and the weights y / (theta . beta_0) and
+  // (2 - y) / (theta . beta_1) of that pass, as columns 2b and 2b+1.
+  // the last two are contiguous per tile, for the matrix kernels
+  vector<uint32_t> _batch_locs;
+  vector<YArray *> _batch_y;
+  vector<uint8_t> _batch_sim;
+  Matrix *_batch_beta;
+  vector<double> _batch_eb;
+  vector<double> _batch_prev_eb;
+  vector<double> _batch_et;
+  vector<double> _batch_w;
+  Matrix *_batch_lambdat;
+  bool _batch_first;
+
+  LocusSchedule *_loc_sched;	// -epoch-block
   
   double _rhot;
   double _noderhot;
@@ -232,6 +488,7 @@ private:
   time_t _start_time;
   struct timeval _last_iter;
   FILE *_lf;
+  ELBO<SNPSamplingG> *_elbo;
 
   Matrix _Elogtheta;
   D3 _Elogbeta;
@@ -258,8 +515,22 @@ private:
   CondMutex _cm;
   ThreadMapG _thread_map;
   ChunkMap _chunk_map;
+  vector<IndivsList *> _tiles;
+  TileScheduler _tile_sched;
+  TSReduce *_lambdat_reduce;
   BoolMap64 _cthreads;
-  bool _hol_mode;
+  FILE *_thf;
+  FILE *_lpf;
+  vector<uint64_t> _lambda_passes;
+  uint64_t _nloci;
+  uint64_t _last_report_loci;
+  uint32_t _last_report_secs;
+  bool _gamma_pending;
+  bool _apply_gamma;
+  uint32_t _gamma_loc;
+  bool _sim_pending;
+  bool _sim_y;
+  Array _sim_beta;
 
   Matrix _phimom;
   Matrix _phidad;
@@ -271,6 +542,62 @@ private:
   YArray *_prev_y;
 
   YArrayMap _heldout_loc_y;
+
+  vector<LocusRunnerG *> _async_runners;
+  volatile uint8_t *_loc_busy;
+  CondMutex _async_cm;
+  volatile bool _async_pause;
+  uint32_t _async_paused;
+
+  // heldout evaluation in flight: the loci, the snapshot it scores
+  // and one log likelihood per locus, summed in order once all are in
+  vector<HeldoutLocG> _hol_locs;
+  vector<HeldoutRunnerG *> _hol_runners;
+  Matrix _hol_Etheta;
+  Matrix _hol_Elogtheta;
+  D3 *_hol_lambda;
+  vector<double> _hol_lsum;
+  bool _hol_first;
+  bool _hol_busy;
+  bool _hol_wanted;
+  volatile bool _hol_ready;
+  uint32_t _hol_gen;
+  volatile uint32_t _hol_next;
+  volatile uint32_t _hol_left;
+  uint32_t _hol_iter;
+  uint32_t _hol_secs;
+  uint64_t _hol_nloci;
+  CondMutex _hol_cm;
+
+  // streaming convergence check (-conv-loci): validation loci drawn at
+  // random are scored against the current beta; latest per-pair score
+  // of each locus and the iteration it was taken at, and the changes
+  // seen since the current sweep began with the iterations they span
+  vector<uint32_t> _sc_locs;
+  HOLikelihood _sc_holike;
+  vector<double> _sc_last;
+  vector<uint32_t> _sc_last_iter;
+  vector<bool> _sc_seen;
+  uint32_t _sc_draws;
+  uint32_t _sc_nseen;
+  double _sc_total;
+  vector<double> _sc_d;
+  vector<uint32_t> _sc_gap;
+  uint32_t _sc_sweep_iter;
+  uint32_t _sc_iter;
+  FILE *_scf;
+
+  // -compute-beta: the loci to fit, claimed in order, and which of
+  // them are done; rows are written out in list order as they arrive
+  vector<uint32_t> _beta_locs;
+  vector<uint8_t> _beta_ready;
+  volatile uint32_t _beta_next;
+  CondMutex _beta_cm;
+
+  // -incremental: the previous individuals, rows [0, _incr_hold),
+  // keep their gamma until _incr_until loci have been seen
+  volatile uint32_t _incr_hold;
+  uint64_t _incr_until;
 };
 
 inline void
@@ -279,7 +606,6 @@ PhiRunnerG::reset(uint32_t loc)
   _lambdat.zero();
   _loc = loc;
   _prev_iter = _iter;
-  _prev_hol_mode = _pop.hol_mode();
   _prev_x = 0;
 }
 
@@ -329,47 +655,6 @@ SNPSamplingG::duration() const
   return t - _start_time;
 }
 
-inline double
-SNPSamplingG::snp_likelihood(uint32_t loc, vector<uint32_t> &indivs, bool first)
-{
-  get_subsample(loc);
-  const yval_t * const snpd = _y->const_data();
-
-  if (first)
-    estimate_beta(loc);
-  else {
-    _loc = loc;
-    optimize_lambda(loc);
-    _iter++;
-  }
-
-  const double ** const thetad = _Etheta.const_data();
-  const double ** const betad = _Ebeta.const_data();
-  double lsum = .0;
-  for (uint32_t i = 0; i < indivs.size(); ++i)  {
-    uint32_t n = indivs[i];
-    assert (!_snp.is_missing(n, loc));
-
-    double sum = .0;
-
-    yval_t x = snpd[n];
-    //yval_t x = snpd[n][loc];
-    double q = .0;
-    double v = gsl_sf_fact(2) / 
-      (gsl_sf_fact(x) * gsl_sf_fact(2 - x));
-    
-    for (uint32_t k = 0; k < _k; ++k)
-      q += betad[loc][k] * thetad[n][k];
-    
-    sum = v * pow(q, x) *  pow(1 - q, 2 - x);
-    if (sum < 1e-30)
-      sum = 1e-30;
-    lsum += log(sum);
-  }
-  tst("logsum=%.5f\t%.5f\n", lsum / indivs.size(), exp(lsum / indivs.size()));
-  return lsum;
-}
-
 inline bool
 SNPSamplingG::kv_ok(uint32_t indiv, uint32_t loc) const
 {
@@ -391,6 +676,208 @@ SNPSamplingG::kv_ok(uint32_t indiv, uint32_t loc) const
   return true;
 }
 
+// a locus' lambda grows with the number of individuals, so its
+// change is measured relative to its mean; revisited loci start
+// from their previous lambda and often settle in one pass
+inline bool
+SNPSamplingG::lambda_converged(uint32_t loc, const Matrix &v) const
+{
+  const double ** const ld = _lambda.const_data()[loc];
+  double s = .0;
+  for (uint32_t k = 0; k < _k; ++k)
+    for (uint32_t t = 0; t < _t; ++t)
+      s += ld[k][t];
+  s /= _k * _t;
+  return v.abs_mean() < _env.lambda_reltol * s;
+}
+
+// Etheta and Elogtheta of individual n after gamma moved by step;
+// returns true if the digammas were recomputed.  with -lazy-theta M
+// that happens every M updates, or once the root sum of squares of
+// gamma's relative steps since the last exact refresh exceeds
+// theta_reltol; in between Elogtheta follows the first-order change
+//   psi'(g_k) dg_k - psi'(sum g) sum dg
+// whose error per step is about half the squared relative step, with
+// psi' from its asymptotic series, accurate for g >= 6.  components
+// below that, typically the populations an individual does not
+// belong to, decaying toward alpha, take their exact digamma against
+// the series' psi(sum g) instead, and do not count toward the drift
+inline bool
+SNPSamplingG::update_theta(uint32_t n, const double *step)
+{
+  const double ** const gd = _gamma.const_data();
+  double **theta = _Etheta.data();
+  double **elogtheta = _Elogtheta.data();
+
+  double s = .0, ds = .0, drift = .0;
+  for (uint32_t k = 0; k < _k; ++k) {
+    s += gd[n][k];
+    ds += step[k];
+    if (gd[n][k] < 6 || gd[n][k] - step[k] < 6)
+      continue;
+    double r = step[k] / gd[n][k];
+    if (r * r > drift)
+      drift = r * r;
+  }
+  assert(s);
+  for (uint32_t k = 0; k < _k; ++k)
+    theta[n][k] = gd[n][k] / s;
+
+  if (_theta_age) {
+    double tol2 = _env.theta_reltol * _env.theta_reltol;
+    uint32_t &age = (*_theta_age)[n];
+    double &d = (*_theta_drift)[n];
+    d += drift;
+    if (++age < _env.lazy_theta && d < tol2 && s - ds >= 6 && s >= 6) {
+      // at the old gamma, g - dg
+      double x = s - ds;
+      double t = 1 / x + 1 / (2 * x * x) + 1 / (6 * x * x * x);
+      double psi_sum = .0;
+      bool have_sum = false;
+      for (uint32_t k = 0; k < _k; ++k) {
+	x = gd[n][k] - step[k];
+	if (x >= 6 && gd[n][k] >= 6) {
+	  double tk = 1 / x + 1 / (2 * x * x) + 1 / (6 * x * x * x);
+	  elogtheta[n][k] += tk * step[k] - t * ds;
+	  continue;
+	}
+	if (!have_sum) {
+	  double y = 1 / (s * s);
+	  psi_sum = log(s) - 1 / (2 * s)
+	    - y * (1.0 / 12 - y * (1.0 / 120 - y / 252));
+	  have_sum = true;
+	}
+	elogtheta[n][k] = gsl_sf_psi(gd[n][k]) - psi_sum;
+      }
+      return false;
+    }
+    age = 0;
+    d = .0;
+  }
+
+  double psi_sum = gsl_sf_psi(s);
+  for (uint32_t k = 0; k < _k; ++k)
+    elogtheta[n][k] = gsl_sf_psi(gd[n][k]) - psi_sum;
+  return true;
+}
+
+inline void
+SNPSamplingG::count_theta(uint32_t exact, uint32_t all)
+{
+  __sync_fetch_and_add(&_theta_exact, (uint64_t)exact);
+  __sync_fetch_and_add(&_theta_all, (uint64_t)all);
+}
+
+// with -active-set P an individual whose gamma steps have become
+// small is frozen: its gamma is updated only at every P-th locus,
+// staggered across individuals, and its phis come from cached
+// exp(Elogtheta) rows rather than an exp and log per component.
+// with -incremental the previous individuals are not updated at all
+// during the warm-up
+inline bool
+SNPSamplingG::gamma_due(uint32_t n) const
+{
+  if (n < _incr_hold)
+    return false;
+  if (!_frozen || !_frozen[n])
+    return true;
+  return (_iter + n) % _env.active_set == 0;
+}
+
+// called after individual n's gamma moved by step and its theta was
+// updated
+inline void
+SNPSamplingG::track_change(uint32_t n, const double *step)
+{
+  if (!_frozen)
+    return;
+  const double ** const gd = _gamma.const_data();
+  double ds = .0, s = .0;
+  for (uint32_t k = 0; k < _k; ++k) {
+    ds += fabs(step[k]);
+    s += gd[n][k];
+  }
+  double &a = (*_act_change)[n];
+  a = 0.9 * a + 0.1 * ds / s;
+  _frozen[n] = a < _env.active_tol;
+  if (_frozen[n]) {
+    const double ** const elogthetad = _Elogtheta.const_data();
+    double *et = _act_etheta->data()[n];
+    for (uint32_t k = 0; k < _k; ++k)
+      et[k] = exp(elogthetad[n][k]);
+  }
+}
+
+inline void
+SNPSamplingG::exp_beta(uint32_t loc, Matrix &ebeta) const
+{
+  const double ** const elogbetad = _Elogbeta.const_data()[loc];
+  double **eb = ebeta.data();
+  for (uint32_t k = 0; k < _k; ++k)
+    for (uint32_t t = 0; t < _t; ++t)
+      eb[k][t] = exp(elogbetad[k][t]);
+}
+
+// phi_k is proportional to exp(Elogtheta_k + Elogbeta_k)
+inline void
+SNPSamplingG::frozen_phis(uint32_t n, const Matrix &ebeta,
+			  double *phimom, double *phidad) const
+{
+  const double * const et = _act_etheta->const_data()[n];
+  const double ** const eb = ebeta.const_data();
+  double s0 = .0, s1 = .0;
+  for (uint32_t k = 0; k < _k; ++k) {
+    phimom[k] = et[k] * eb[k][0];
+    phidad[k] = et[k] * eb[k][1];
+    s0 += phimom[k];
+    s1 += phidad[k];
+  }
+  for (uint32_t k = 0; k < _k; ++k) {
+    phimom[k] /= s0;
+    phidad[k] /= s1;
+  }
+}
+
+// phis normalized over the support only, the rest being exactly zero
+inline void
+SNPSamplingG::topm_phis(uint32_t n, uint32_t loc,
+			double *phimom, double *phidad) const
+{
+  const uint32_t * const idx = _topm_idx->const_data()[n];
+  const double * const elogthetad = _Elogtheta.const_data()[n];
+  const double ** const elogbetad = _Elogbeta.const_data()[loc];
+  uint32_t m = _env.topm;
+  double m0 = -1e300, m1 = -1e300;
+  for (uint32_t j = 0; j < m; ++j) {
+    uint32_t k = idx[j];
+    phimom[j] = elogthetad[k] + elogbetad[k][0];
+    phidad[j] = elogthetad[k] + elogbetad[k][1];
+    if (phimom[j] > m0)
+      m0 = phimom[j];
+    if (phidad[j] > m1)
+      m1 = phidad[j];
+  }
+  double s0 = .0, s1 = .0;
+  for (uint32_t j = 0; j < m; ++j) {
+    phimom[j] = exp(phimom[j] - m0);
+    phidad[j] = exp(phidad[j] - m1);
+    s0 += phimom[j];
+    s1 += phidad[j];
+  }
+  for (uint32_t j = 0; j < m; ++j) {
+    phimom[j] /= s0;
+    phidad[j] /= s1;
+  }
+}
+
+inline uint32_t
+SNPSamplingG::next_loc()
+{
+  if (_loc_sched)
+    return _loc_sched->next(_r);
+  return gsl_rng_uniform_int(_r, _l);
+}
+
 inline double
 SNPSamplingG::logcoeff(yval_t x) {
   uint32_t c = 2;
@@ -401,11 +888,21 @@ inline int
 PhiRunnerG::process(const IndivsList &v)
 {
   double u = 1./_k;
+  if (_env.active_set > 0)
+    _pop.exp_beta(_loc, _ebeta);
   for (uint32_t i = 0; i < v.size(); ++i) {
     uint32_t n = v[i];
     if (!_pop.kv_ok(n, _loc))
       continue;
     
+    if (_pop.topm()) {
+      _pop.topm_phis(n, _loc, _phimom.data()[n], _phidad.data()[n]);
+      continue;
+    }
+    if (_pop.frozen(n)) {
+      _pop.frozen_phis(n, _ebeta, _phimom.data()[n], _phidad.data()[n]);
+      continue;
+    }
     _phimom.set_elements(n, u);
     _phidad.set_elements(n, u);
     update_phimom(n);
@@ -414,16 +911,4 @@ PhiRunnerG::process(const IndivsList &v)
   update_lambda_t(v);
 }
 
-inline void
-PhiRunnerG::update_gamma()
-{
-  update_gamma(*_oldilist);
-}
-
-inline void
-PhiRunnerG::estimate_theta()
-{
-  estimate_theta(*_oldilist);
-}
-
 #endif
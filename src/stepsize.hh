@@ -0,0 +1,120 @@
+#ifndef STEPSIZE_HH
+#define STEPSIZE_HH
+
+#include <stdint.h>
+#include <math.h>
+#include <vector>
+#include "env.hh"
+#include "matrix.hh"
+
+// Robbins-Monro step sizes (tau0 + c)^-kappa without a pow() per
+// update: exact for c < FINE, linearly interpolated between every
+// STRIDE-th count up to FINE * STRIDE (relative error below 1e-5),
+// and computed directly beyond
+class RhoTable {
+public:
+  RhoTable(double tau0, double kappa);
+
+  double operator()(uint32_t c) const;
+
+  static const uint32_t FINE = 1 << 16;
+  static const uint32_t STRIDE = 1 << 8;
+
+private:
+  double _tau0;
+  double _kappa;
+  vector<double> _fine;
+  vector<double> _coarse;
+};
+
+inline
+RhoTable::RhoTable(double tau0, double kappa)
+  : _tau0(tau0), _kappa(kappa), _fine(FINE), _coarse(FINE + 1)
+{
+  for (uint32_t c = 0; c < FINE; ++c)
+    _fine[c] = pow(_tau0 + c, -1 * _kappa);
+  for (uint32_t i = 0; i <= FINE; ++i)
+    _coarse[i] = pow(_tau0 + (double)i * STRIDE, -1 * _kappa);
+}
+
+inline double
+RhoTable::operator()(uint32_t c) const
+{
+  if (c < FINE)
+    return _fine[c];
+  uint32_t i = c / STRIDE;
+  if (i >= FINE)
+    return pow(_tau0 + c, -1 * _kappa);
+  double f = (double)(c % STRIDE) / STRIDE;
+  return _coarse[i] + f * (_coarse[i + 1] - _coarse[i]);
+}
+
+// per-individual adaptive step size for the noisy natural gradient
+// steps on gamma (Ranganath et al., "An adaptive learning rate for
+// stochastic variational inference", 2013): with running averages
+// gbar of the step g and hbar of g'g over a window tau,
+//   rho = gbar'gbar / hbar,  tau <- tau (1 - rho) + 1
+// rho is near 1 while the steps agree and falls as they turn into
+// noise, so no tau0/kappa need be set.  the steps scale with gamma,
+// which makes AdaGrad/Adam-style g / sqrt(sum g^2) steps a poor fit
+// here; this rate is scale-free
+//
+// an individual's state is only touched by the thread updating its
+// gamma, as gamma itself
+class AdaptiveRho {
+public:
+  AdaptiveRho(uint32_t n, uint32_t k);
+
+  double next(uint32_t n, const double *g);
+
+private:
+  uint32_t _k;
+  Matrix _gbar;
+  Array _hbar;
+  Array _tau;
+};
+
+inline
+AdaptiveRho::AdaptiveRho(uint32_t n, uint32_t k)
+  : _k(k), _gbar(n, k), _hbar(n), _tau(n)
+{
+  _hbar.zero();
+  _tau.zero();
+}
+
+inline double
+AdaptiveRho::next(uint32_t n, const double *g)
+{
+  double *gbar = _gbar.data()[n];
+  double gg = .0;
+  for (uint32_t k = 0; k < _k; ++k)
+    gg += g[k] * g[k];
+
+  double tau = _tau[n];
+  if (tau == .0) {
+    // the first step seeds the averages and is taken in full; the
+    // window starts at ten steps
+    for (uint32_t k = 0; k < _k; ++k)
+      gbar[k] = g[k];
+    _hbar[n] = gg;
+    _tau[n] = 10.0;
+    return 1.0;
+  }
+
+  double w = 1.0 / tau;
+  double bb = .0;
+  for (uint32_t k = 0; k < _k; ++k) {
+    gbar[k] = (1 - w) * gbar[k] + w * g[k];
+    bb += gbar[k] * gbar[k];
+  }
+  double h = (1 - w) * _hbar[n] + w * gg;
+  _hbar[n] = h;
+
+  double rho = h > 0 ? bb / h : 1.0;
+  if (rho > 1.0)
+    rho = 1.0;
+  _tau[n] = tau * (1 - rho) + 1;
+  return rho;
+}
+
+#endif
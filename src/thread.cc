@@ -1,6 +1,7 @@
 #include "thread.hh"
 #include <stdio.h>
 #include <string.h>
+#include <sched.h>
 
 pthread_mutex_t Thread::_file_mutex;
 
@@ -45,6 +46,22 @@ Thread::join()
   return 0;
 }
 
+// bind the calling thread to a single cpu
+int
+Thread::pin(int cpu)
+{
+#ifdef __linux__
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(cpu, &set);
+  if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0)
+    return -1;
+  return 0;
+#else
+  return -1;
+#endif
+}
+
 void *
 Thread::run(void *obj)      // static method
 {
@@ -17,6 +17,7 @@ public:
   int create();
   int join();
   pthread_t id() const { return _tid; }
+  int pin(int cpu);
 
   virtual int do_work() { return 0; }
   
@@ -0,0 +1,164 @@
+#ifndef TILESCHED_HH
+#define TILESCHED_HH
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <stdio.h>
+
+#define TILESCHED_LINE 64
+
+// per-owner deques of tile ids with work stealing
+//
+// each owner gets a contiguous range of tiles [first, last); the owner
+// pops from the front, thieves steal from the back.  the (gen, head,
+// tail) triple of a deque lives in one 64 bit word that is only ever
+// changed by compare-and-swap, so pop and steal need no locks.  the
+// generation tag keeps a thread that is late from the previous pass
+// from grabbing tiles of the next one
+class TileScheduler {
+public:
+  TileScheduler(uint32_t nowners);
+  ~TileScheduler();
+
+  void set_range(uint32_t owner, uint32_t first, uint32_t last);
+  uint32_t begin();
+  uint32_t gen() const { return _gen; }
+  bool next(uint32_t owner, uint32_t gen, uint32_t &tile);
+
+  uint32_t nowners() const { return _nowners; }
+  uint64_t steals() const { return _steals; }
+
+private:
+  static const uint32_t IDX_BITS = 22;
+  static const uint64_t IDX_MASK = (1ULL << IDX_BITS) - 1;
+  static const uint64_t GEN_MASK = (1ULL << (64 - 2 * IDX_BITS)) - 1;
+
+  static uint64_t pack(uint32_t g, uint32_t h, uint32_t t);
+  static uint32_t gen_of(uint64_t w)  { return (w >> (2 * IDX_BITS)) & GEN_MASK; }
+  static uint32_t head_of(uint64_t w) { return (w >> IDX_BITS) & IDX_MASK; }
+  static uint32_t tail_of(uint64_t w) { return w & IDX_MASK; }
+
+  volatile uint64_t &word(uint32_t owner) { return _words[owner * _stride]; }
+  bool pop(uint32_t owner, uint32_t g, uint32_t &tile);
+  bool steal(uint32_t victim, uint32_t g, uint32_t &tile);
+
+  uint32_t _nowners;
+  uint32_t _stride;
+  volatile uint64_t *_words;
+  uint32_t *_first;
+  uint32_t *_last;
+  uint32_t _gen;
+  volatile uint64_t _steals;
+
+  TileScheduler &operator=(const TileScheduler &);
+  TileScheduler(const TileScheduler &);
+};
+
+inline
+TileScheduler::TileScheduler(uint32_t nowners)
+  : _nowners(nowners),
+    _stride(TILESCHED_LINE / sizeof(uint64_t)),
+    _words(NULL),
+    _first(new uint32_t[nowners]),
+    _last(new uint32_t[nowners]),
+    _gen(0), _steals(0)
+{
+  // one deque word per cache line
+  void *p = NULL;
+  size_t sz = (size_t)(_nowners > 0 ? _nowners : 1) * TILESCHED_LINE;
+  if (posix_memalign(&p, TILESCHED_LINE, sz) != 0) {
+    fprintf(stderr, "cannot allocate tile deques\n");
+    exit(-1);
+  }
+  memset(p, 0, sz);
+  _words = (volatile uint64_t *)p;
+  memset(_first, 0, _nowners * sizeof(uint32_t));
+  memset(_last, 0, _nowners * sizeof(uint32_t));
+}
+
+inline
+TileScheduler::~TileScheduler()
+{
+  free((void *)_words);
+  delete[] _first;
+  delete[] _last;
+}
+
+inline uint64_t
+TileScheduler::pack(uint32_t g, uint32_t h, uint32_t t)
+{
+  return (((uint64_t)g & GEN_MASK) << (2 * IDX_BITS)) |
+    (((uint64_t)h & IDX_MASK) << IDX_BITS) | ((uint64_t)t & IDX_MASK);
+}
+
+inline void
+TileScheduler::set_range(uint32_t owner, uint32_t first, uint32_t last)
+{
+  assert (owner < _nowners);
+  assert (first <= last && last <= IDX_MASK);
+  _first[owner] = first;
+  _last[owner] = last;
+}
+
+// main thread only, while no worker is inside next(); refills every
+// deque and returns the tag workers must present for this pass
+inline uint32_t
+TileScheduler::begin()
+{
+  _gen = (_gen + 1) & GEN_MASK;
+  for (uint32_t i = 0; i < _nowners; ++i)
+    word(i) = pack(_gen, _first[i], _last[i]);
+  __sync_synchronize();
+  return _gen;
+}
+
+inline bool
+TileScheduler::pop(uint32_t owner, uint32_t g, uint32_t &tile)
+{
+  volatile uint64_t &w = word(owner);
+  do {
+    uint64_t v = w;
+    uint32_t h = head_of(v), t = tail_of(v);
+    if (gen_of(v) != g || h >= t)
+      return false;
+    if (__sync_bool_compare_and_swap(&w, v, pack(g, h + 1, t))) {
+      tile = h;
+      return true;
+    }
+  } while (1);
+}
+
+inline bool
+TileScheduler::steal(uint32_t victim, uint32_t g, uint32_t &tile)
+{
+  volatile uint64_t &w = word(victim);
+  do {
+    uint64_t v = w;
+    uint32_t h = head_of(v), t = tail_of(v);
+    if (gen_of(v) != g || h >= t)
+      return false;
+    if (__sync_bool_compare_and_swap(&w, v, pack(g, h, t - 1))) {
+      tile = t - 1;
+      __sync_add_and_fetch(&_steals, 1);
+      return true;
+    }
+  } while (1);
+}
+
+// deques only shrink during a pass, so one sweep over the victims
+// is enough to tell that the pass has no work left
+inline bool
+TileScheduler::next(uint32_t owner, uint32_t g, uint32_t &tile)
+{
+  assert (owner < _nowners);
+  if (pop(owner, g, tile))
+    return true;
+  for (uint32_t i = 1; i < _nowners; ++i)
+    if (steal((owner + i) % _nowners, g, tile))
+      return true;
+  return false;
+}
+
+#endif
@@ -0,0 +1,160 @@
+#ifndef TOPOLOGY_HH
+#define TOPOLOGY_HH
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sched.h>
+#include <vector>
+#include <string>
+#include <sstream>
+#include <algorithm>
+
+using namespace std;
+
+// numa nodes and their cpus, read from sysfs; no libnuma needed.
+// falls back to a single node holding every online cpu
+class Topology {
+public:
+  Topology();
+
+  uint32_t nnodes() const { return _nodes.size(); }
+  const vector<uint32_t> &cpus(uint32_t node) const { return _nodes[node]; }
+  int cpu_for(uint32_t i, uint32_t nworkers, uint32_t &node) const;
+  string s() const;
+
+private:
+  void read_sysfs();
+  bool allowed(uint32_t cpu) const;
+  static void parse_cpulist(const char *s, vector<uint32_t> &v);
+
+  vector< vector<uint32_t> > _nodes;
+#ifdef __linux__
+  cpu_set_t _allowed;
+  bool _have_allowed;
+#endif
+};
+
+inline
+Topology::Topology()
+{
+#ifdef __linux__
+  CPU_ZERO(&_allowed);
+  _have_allowed = (sched_getaffinity(0, sizeof(_allowed), &_allowed) == 0);
+#endif
+  read_sysfs();
+  if (_nodes.size() == 0) {
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    vector<uint32_t> v;
+    for (long i = 0; i < n; ++i)
+      if (allowed(i))
+	v.push_back(i);
+    if (v.size() == 0)
+      v.push_back(0);
+    _nodes.push_back(v);
+  }
+}
+
+inline bool
+Topology::allowed(uint32_t cpu) const
+{
+#ifdef __linux__
+  if (_have_allowed && cpu < CPU_SETSIZE)
+    return CPU_ISSET(cpu, &_allowed);
+#endif
+  return true;
+}
+
+// "0-15,32-47" -> 0..15 32..47
+inline void
+Topology::parse_cpulist(const char *s, vector<uint32_t> &v)
+{
+  const char *p = s;
+  while (*p) {
+    char *q = NULL;
+    long a = strtol(p, &q, 10);
+    if (q == p)
+      break;
+    long b = a;
+    p = q;
+    if (*p == '-') {
+      b = strtol(p + 1, &q, 10);
+      p = q;
+    }
+    for (long c = a; c <= b; ++c)
+      v.push_back(c);
+    if (*p == ',')
+      p++;
+    else
+      break;
+  }
+}
+
+inline void
+Topology::read_sysfs()
+{
+  const char *dname = "/sys/devices/system/node";
+  DIR *d = opendir(dname);
+  if (!d)
+    return;
+
+  vector<uint32_t> ids;
+  struct dirent *e;
+  while ((e = readdir(d)) != NULL) {
+    uint32_t id;
+    if (strncmp(e->d_name, "node", 4) == 0 &&
+	sscanf(e->d_name + 4, "%u", &id) == 1)
+      ids.push_back(id);
+  }
+  closedir(d);
+  sort(ids.begin(), ids.end());
+
+  char fname[256], b[4096];
+  for (uint32_t i = 0; i < ids.size(); ++i) {
+    sprintf(fname, "%s/node%u/cpulist", dname, ids[i]);
+    FILE *f = fopen(fname, "r");
+    if (!f)
+      continue;
+    vector<uint32_t> all, v;
+    if (fgets(b, sizeof(b), f) != NULL)
+      parse_cpulist(b, all);
+    fclose(f);
+    for (uint32_t j = 0; j < all.size(); ++j)
+      if (allowed(all[j]))
+	v.push_back(all[j]);
+    if (v.size() > 0)     // memory-only or fenced-off nodes
+      _nodes.push_back(v);
+  }
+}
+
+// spread nworkers over the nodes in contiguous blocks, so that
+// neighbouring workers (and their neighbouring individuals) share a
+// node, then round-robin over each node's cpus
+inline int
+Topology::cpu_for(uint32_t i, uint32_t nworkers, uint32_t &node) const
+{
+  if (nworkers == 0 || _nodes.size() == 0)
+    return -1;
+  node = (uint64_t)i * _nodes.size() / nworkers;
+  uint32_t first = (node * nworkers + _nodes.size() - 1) / _nodes.size();
+  const vector<uint32_t> &v = _nodes[node];
+  return v[(i - first) % v.size()];
+}
+
+inline string
+Topology::s() const
+{
+  ostringstream sa;
+  for (uint32_t i = 0; i < _nodes.size(); ++i) {
+    sa << "node" << i << ":";
+    for (uint32_t j = 0; j < _nodes[i].size(); ++j)
+      sa << (j ? "," : "") << _nodes[i][j];
+    sa << " ";
+  }
+  return sa.str();
+}
+
+#endif
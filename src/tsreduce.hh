@@ -0,0 +1,133 @@
+#ifndef TSREDUCE_HH
+#define TSREDUCE_HH
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "matrix.hh"
+
+#define CACHE_LINE_SIZE 64
+
+// per-worker accumulators combined by a fixed-order binary tree
+//
+// slot i holds the contribution of chunk (or tile) i; node (i, s)
+// combines slot i and slot i + 2^s into slot i.  whichever thread
+// arrives second at a node does the addition, so nobody waits on a
+// sibling, yet the shape of the tree -- and hence the floating point
+// result -- depends only on the number of slots, never on timing
+class TSReduce {
+public:
+  TSReduce(uint32_t nslots, uint32_t m, uint32_t n);
+  ~TSReduce();
+
+  bool contribute(uint32_t i, const D2Array<double> &v);
+  void result(D2Array<double> &v) const;
+  uint32_t nslots() const { return _nslots; }
+
+private:
+  double *slot(uint32_t i) const { return _slots + i * _stride; }
+  uint32_t levels() const;
+
+  uint32_t _nslots;
+  uint32_t _nlevels;
+  uint32_t _m;
+  uint32_t _n;
+  uint32_t _stride;
+  double *_slots;
+  volatile uint32_t *_arrivals;
+
+  TSReduce &operator=(const TSReduce &);
+  TSReduce(const TSReduce &);
+};
+
+inline
+TSReduce::TSReduce(uint32_t nslots, uint32_t m, uint32_t n)
+  : _nslots(nslots), _nlevels(0), _m(m), _n(n),
+    _stride(0), _slots(NULL), _arrivals(NULL)
+{
+  _nlevels = levels();
+
+  // pad every slot out to its own cache line
+  uint32_t per_line = CACHE_LINE_SIZE / sizeof(double);
+  _stride = ((_m * _n + per_line - 1) / per_line) * per_line;
+
+  void *p = NULL;
+  size_t ssz = (size_t)_nslots * _stride * sizeof(double);
+  if (posix_memalign(&p, CACHE_LINE_SIZE, ssz > 0 ? ssz : CACHE_LINE_SIZE) != 0) {
+    fprintf(stderr, "cannot allocate reduction slots\n");
+    exit(-1);
+  }
+  memset(p, 0, ssz);
+  _slots = (double *)p;
+
+  uint32_t asz = _nslots * (_nlevels > 0 ? _nlevels : 1);
+  _arrivals = new uint32_t[asz];
+  memset((void *)_arrivals, 0, asz * sizeof(uint32_t));
+}
+
+inline
+TSReduce::~TSReduce()
+{
+  free(_slots);
+  delete[] _arrivals;
+}
+
+inline uint32_t
+TSReduce::levels() const
+{
+  uint32_t l = 0;
+  for (uint32_t step = 1; step < _nslots; step <<= 1)
+    l++;
+  return l;
+}
+
+// returns true for the thread that completes the root; slot 0 then
+// holds the full sum until the next pass begins
+inline bool
+TSReduce::contribute(uint32_t i, const D2Array<double> &v)
+{
+  assert (i < _nslots);
+  assert (v.m() == _m && v.n() == _n);
+
+  double *s = slot(i);
+  const double ** const vd = v.const_data();
+  for (uint32_t a = 0; a < _m; ++a)
+    for (uint32_t b = 0; b < _n; ++b)
+      s[a * _n + b] = vd[a][b];
+
+  uint32_t level = 0;
+  for (uint32_t step = 1; step < _nslots; step <<= 1, ++level) {
+    uint32_t left = i & ~step;
+    uint32_t right = left + step;
+    if (right >= _nslots) {   // no sibling at this level
+      i = left;
+      continue;
+    }
+    // each node sees exactly two arrivals per pass; the first one
+    // leaves and the second one (odd -> even count) combines
+    uint32_t c = __sync_add_and_fetch(&_arrivals[left * _nlevels + level], 1);
+    if (c & 1)
+      return false;
+    double *l = slot(left);
+    const double *r = slot(right);
+    for (uint32_t j = 0; j < _m * _n; ++j)
+      l[j] += r[j];
+    i = left;
+  }
+  __sync_synchronize();
+  return true;
+}
+
+inline void
+TSReduce::result(D2Array<double> &v) const
+{
+  assert (v.m() == _m && v.n() == _n);
+  __sync_synchronize();
+  const double *s = slot(0);
+  double **vd = v.data();
+  for (uint32_t a = 0; a < _m; ++a)
+    for (uint32_t b = 0; b < _n; ++b)
+      vd[a][b] = s[a * _n + b];
+}
+
+#endif